@@ -1,17 +1,23 @@
 /* Implementation of simple command-line interface */
 
 #include <ctype.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <limits.h>
+#include <math.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <sys/select.h>
 #include <sys/stat.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "console.h"
+#include "perf.h"
 #include "report.h"
 #include "web.h"
 
@@ -20,6 +26,7 @@ int simulation = 0;
 int show_entropy = 0;
 static cmd_element_t *cmd_list = NULL;
 static param_element_t *param_list = NULL;
+static int perf_enabled = 0;
 static bool block_flag = false;
 static bool prompt_flag = true;
 
@@ -31,20 +38,25 @@ static double first_time, last_time;
 
 /* Implement buffered I/O using variant of RIO package from CS:APP
  * Must create stack of buffers to handle I/O with nested source commands.
+ * Regular files are memory-mapped as a whole instead, and lines are handed
+ * to the interpreter where they lie, in the mapping or the buffer.
  */
 
-#define RIO_BUFSIZE 8192
+#define RIO_BUFSIZE (64 * 1024)
 
 typedef struct __rio {
-    int fd;                /* File descriptor */
-    int count;             /* Unread bytes in internal buffer */
-    char *bufptr;          /* Next unread byte in internal buffer */
-    char buf[RIO_BUFSIZE]; /* Internal buffer */
-    struct __rio *prev;    /* Next element in stack */
+    int fd;             /* File descriptor */
+    char *map;          /* Mapping of the whole file, NULL if read */
+    size_t map_size;    /* Size of @map */
+    size_t count;       /* Unread bytes in mapping or internal buffer */
+    char *bufptr;       /* Next unread byte in mapping or internal buffer */
+    char *name;         /* File name, NULL for standard input */
+    int line;           /* Number of lines read */
+    struct __rio *prev; /* Next element in stack */
+    char buf[];         /* Internal buffer of RIO_BUFSIZE if not mapped */
 } rio_t;
 
 static rio_t *buf_stack;
-static char linebuf[RIO_BUFSIZE];
 
 /* Maximum file descriptor */
 static int fd_max = 0;
@@ -65,13 +77,111 @@ static bool has_infile = false;
 static cmd_func_t quit_helpers[MAXQUIT];
 static int quit_helper_cnt = 0;
 
+/* Optional functions to call before and after every command */
+#define MAXHOOK 10
+static cmd_hook_t cmd_hooks[MAXHOOK];
+static int cmd_hook_cnt = 0;
+static cmd_hook_t cmd_post_hooks[MAXHOOK];
+static int cmd_post_hook_cnt = 0;
+
+/* Latency histogram of a command in nanoseconds, HDR style: values below
+ * 2^LAT_SUB_BITS have a bucket each, and every higher power of two is split
+ * into 2^LAT_SUB_BITS buckets, so that percentiles are within about 3%.
+ */
+#define LAT_SUB_BITS 5
+#define LAT_SUB (1 << LAT_SUB_BITS)
+#define LAT_BUCKETS ((65 - LAT_SUB_BITS) << LAT_SUB_BITS)
+
+typedef struct __latency {
+    uint64_t count, min, max;
+    uint64_t buckets[LAT_BUCKETS];
+} latency_t;
+
 static void init_in();
 
 static bool push_file(char *fname);
 static void pop_file();
+static const char *readline(size_t *lenp);
 
 static bool interpret_cmda(int argc, char *argv[]);
 
+/* Commands and parameters are also kept in open-addressing hash tables keyed
+ * on their name, so that finding one does not scan the sorted lists.  Both
+ * element types start with their name.
+ */
+#define MIN_TABLE_SLOTS 64
+
+typedef struct {
+    void **slots;
+    size_t nslots; /* Power of 2 */
+    size_t count;
+} name_table_t;
+
+static name_table_t cmd_table, param_table;
+
+static inline const char *elem_name(const void *elem)
+{
+    return *(char *const *) elem;
+}
+
+/* FNV-1a */
+static size_t name_hash(const char *s)
+{
+    uint32_t h = 2166136261u;
+    while (*s)
+        h = (h ^ (unsigned char) *s++) * 16777619u;
+    return h;
+}
+
+static void *table_find(const name_table_t *t, const char *name)
+{
+    if (!t->slots)
+        return NULL;
+    size_t mask = t->nslots - 1;
+    for (size_t i = name_hash(name) & mask; t->slots[i]; i = (i + 1) & mask) {
+        if (!strcmp(elem_name(t->slots[i]), name))
+            return t->slots[i];
+    }
+    return NULL;
+}
+
+/* Add @elem, replacing an element of the same name like the lists do */
+static void table_add(name_table_t *t, void *elem)
+{
+    if ((t->count + 1) * 2 > t->nslots) {
+        size_t nslots = t->nslots ? 2 * t->nslots : MIN_TABLE_SLOTS;
+        void **old = t->slots;
+        size_t old_nslots = t->nslots;
+        t->slots = calloc_or_fail(nslots, sizeof(void *), "table_add");
+        t->nslots = nslots;
+        t->count = 0;
+        for (size_t i = 0; i < old_nslots; i++) {
+            if (old[i])
+                table_add(t, old[i]);
+        }
+        if (old)
+            free_array(old, old_nslots, sizeof(void *));
+    }
+
+    size_t mask = t->nslots - 1;
+    size_t i = name_hash(elem_name(elem)) & mask;
+    for (; t->slots[i]; i = (i + 1) & mask) {
+        if (!strcmp(elem_name(t->slots[i]), elem_name(elem)))
+            break;
+    }
+    if (!t->slots[i])
+        t->count++;
+    t->slots[i] = elem;
+}
+
+static void table_clear(name_table_t *t)
+{
+    if (t->slots)
+        free_array(t->slots, t->nslots, sizeof(void *));
+    t->slots = NULL;
+    t->nslots = t->count = 0;
+}
+
 /* Add a new command */
 void add_cmd(char *name, cmd_func_t operation, char *summary, char *param)
 {
@@ -87,8 +197,10 @@ void add_cmd(char *name, cmd_func_t operation, char *summary, char *param)
     cmd->operation = operation;
     cmd->summary = summary;
     cmd->param = param;
+    cmd->latency = NULL;
     cmd->next = next_cmd;
     *last_loc = cmd;
+    table_add(&cmd_table, cmd);
 }
 
 /* Add a new parameter */
@@ -109,26 +221,54 @@ void add_param(char *name, int *valp, char *summary, setter_func_t setter)
     param->setter = setter;
     param->next = next_param;
     *last_loc = param;
+    table_add(&param_table, param);
 }
 
-/* Parse a string into a command line */
-static char **parse_args(char *line, int *argcp)
+/* Command lines are split into an arena used as a stack, so that parsing does
+ * not allocate: a command running others, as source, time or bench do,
+ * keeps its arguments below those of the nested ones.  A line too long for
+ * the space left is split into a heap buffer instead.
+ */
+#define ARENA_SIZE (64 * 1024)
+
+static char *arena[ARENA_SIZE / sizeof(char *)];
+static size_t arena_top = 0; /* In pointers */
+
+typedef struct {
+    int argc;
+    char **argv;
+    size_t mark;       /* Top of the arena before the line */
+    size_t heap_slots; /* Size of the heap buffer, 0 if in the arena */
+} cmdline_t;
+
+/* Take @slots pointers of room for the arguments of @cl */
+static void reserve_args(size_t slots, cmdline_t *cl)
 {
-    /* Must first determine how many arguments there are.
-     * Replace all white space with null characters
-     */
-    size_t len = strlen(line);
+    cl->mark = arena_top;
+    if (arena_top + slots <= ARENA_SIZE / sizeof(char *)) {
+        cl->argv = arena + arena_top;
+        cl->heap_slots = 0;
+        arena_top += slots;
+    } else {
+        cl->argv = malloc_or_fail(slots * sizeof(char *), "reserve_args");
+        cl->heap_slots = slots;
+    }
+}
 
-    /* First copy into buffer with each substring null-terminated */
-    char *buf = malloc_or_fail(len + 1, "parse_args");
-    buf[len] = '\0';
+/* Split the @len bytes of @line at white space into @cl.  The arguments are
+ * laid out as an array of pointers followed by the words.
+ */
+static void parse_args(const char *line, size_t len, cmdline_t *cl)
+{
+    /* At most one word per two characters, and a NULL at the end */
+    size_t ptrs = len / 2 + 2;
+    reserve_args(ptrs + (len + sizeof(char *)) / sizeof(char *), cl);
 
-    char *src = line;
-    char *dst = buf;
+    char *dst = (char *) (cl->argv + ptrs);
     bool skipping = true;
-    int c;
     int argc = 0;
-    while ((c = *src++) != '\0') {
+    for (const char *end = line + len; line < end && *line; line++) {
+        int c = *line;
         if (isspace(c)) {
             if (!skipping) {
                 /* Hit end of word */
@@ -138,28 +278,32 @@ static char **parse_args(char *line, int *argcp)
         } else {
             if (skipping) {
                 /* Hit start of new word */
-                argc++;
+                cl->argv[argc++] = dst;
                 skipping = false;
             }
             *dst++ = c;
         }
     }
+    *dst = '\0';
+    cl->argv[argc] = NULL;
+    cl->argc = argc;
+}
 
-    /* Now assemble into array of strings */
-    char **argv = calloc_or_fail(argc, sizeof(char *), "parse_args");
-    src = buf;
-    for (int i = 0; i < argc; i++) {
-        argv[i] = strsave_or_fail(src, "parse_args");
-        src += strlen(argv[i]) + 1;
-    }
-
-    free_block(buf, len + 1);
-    *argcp = argc;
-    return argv;
+static void release_args(cmdline_t *cl)
+{
+    if (cl->heap_slots)
+        free_array(cl->argv, cl->heap_slots, sizeof(char *));
+    arena_top = cl->mark;
 }
 
+/* Where the command being run was read from, for error messages */
+static const char *cur_file = NULL;
+static int cur_line = 0;
+
 static void record_error()
 {
+    if (cur_file)
+        report(1, "Error at %s:%d", cur_file, cur_line);
     err_cnt++;
     if (err_cnt >= err_limit) {
         report(1, "Error limit exceeded.  Stopping command execution");
@@ -167,18 +311,159 @@ static void record_error()
     }
 }
 
-/* Execute a command that has already been split into arguments */
-static bool interpret_cmda(int argc, char *argv[])
+/* Bucket of the histogram holding @ns */
+static int latency_bucket(uint64_t ns)
+{
+    if (ns < LAT_SUB)
+        return ns;
+    int e = 63 - __builtin_clzll(ns);
+    uint64_t m = ns >> (e - LAT_SUB_BITS); /* In [LAT_SUB, 2 * LAT_SUB) */
+    return ((e - LAT_SUB_BITS + 1) << LAT_SUB_BITS) + m - LAT_SUB;
+}
+
+/* Highest value falling into bucket @i */
+static uint64_t latency_value(int i)
+{
+    if (i < LAT_SUB)
+        return i;
+    int shift = (i >> LAT_SUB_BITS) - 1;
+    uint64_t m = (i & (LAT_SUB - 1)) + LAT_SUB;
+    return ((m + 1) << shift) - 1;
+}
+
+static void record_latency(cmd_element_t *cmd, uint64_t ns)
+{
+    latency_t *lat = cmd->latency;
+    if (!lat) {
+        /* Not charged to the queue under test, as calloc_or_fail() would */
+        lat = calloc(1, sizeof(latency_t));
+        if (!lat)
+            return;
+        lat->min = UINT64_MAX;
+        cmd->latency = lat;
+    }
+    lat->count++;
+    if (ns < lat->min)
+        lat->min = ns;
+    if (ns > lat->max)
+        lat->max = ns;
+    lat->buckets[latency_bucket(ns)]++;
+}
+
+/* Value below which a fraction @q of the latencies lie */
+static uint64_t latency_quantile(const latency_t *lat, double q)
+{
+    uint64_t rank = (uint64_t) (q * lat->count + 0.999999);
+    if (rank < 1)
+        rank = 1;
+    uint64_t seen = 0;
+    for (int i = 0; i < LAT_BUCKETS; i++) {
+        seen += lat->buckets[i];
+        if (seen >= rank) {
+            uint64_t v = latency_value(i);
+            return v < lat->min ? lat->min : v > lat->max ? lat->max : v;
+        }
+    }
+    return lat->max;
+}
+
+/* Show the counts of hardware events between @start and @end */
+static void report_perf(const uint64_t *start, const uint64_t *end)
+{
+    static const char *names[PERF_NR] = {
+        [PERF_L1D_MISSES] = "L1D",
+        [PERF_LLC_MISSES] = "LLC",
+        [PERF_BRANCH_MISSES] = "branch",
+        [PERF_DTLB_MISSES] = "dTLB",
+    };
+    uint64_t d[PERF_NR];
+    for (int e = 0; e < PERF_NR; e++)
+        d[e] = end[e] - start[e];
+
+    /* Misses are given per 1000 instructions (MPKI) when these are known */
+    bool per_insn = perf_counting(PERF_INSTRUCTIONS) && d[PERF_INSTRUCTIONS];
+    char buf[MAX_CHAR];
+    int len = snprintf(buf, sizeof(buf), "Perf:");
+    const char *sep = " ";
+    if (perf_counting(PERF_CYCLES)) {
+        len += snprintf(buf + len, sizeof(buf) - len, "%s%lu cycles", sep,
+                        (unsigned long) d[PERF_CYCLES]);
+        sep = ", ";
+    }
+    if (perf_counting(PERF_INSTRUCTIONS)) {
+        len += snprintf(buf + len, sizeof(buf) - len, "%s%lu instructions",
+                        sep, (unsigned long) d[PERF_INSTRUCTIONS]);
+        if (perf_counting(PERF_CYCLES) && d[PERF_CYCLES])
+            len += snprintf(buf + len, sizeof(buf) - len, ", IPC %.2f",
+                            (double) d[PERF_INSTRUCTIONS] / d[PERF_CYCLES]);
+        sep = ", ";
+    }
+    for (int e = PERF_L1D_MISSES; e < PERF_NR; e++) {
+        if (!perf_counting(e))
+            continue;
+        if (per_insn)
+            len += snprintf(buf + len, sizeof(buf) - len, "%s%s %.2f MPKI",
+                            sep, names[e],
+                            d[e] * 1000.0 / d[PERF_INSTRUCTIONS]);
+        else
+            len += snprintf(buf + len, sizeof(buf) - len, "%s%s %lu misses",
+                            sep, names[e], (unsigned long) d[e]);
+        sep = ", ";
+    }
+    report(1, "%s", buf);
+}
+
+static void perf_setter(int oldval)
+{
+    if (!perf_enabled) {
+        perf_close();
+        return;
+    }
+    if (oldval)
+        return;
+
+    int opened = perf_open();
+    if (!opened) {
+        report(1, "Hardware performance counters unavailable: %s",
+               strerror(errno));
+        perf_enabled = 0;
+    } else if (opened < PERF_NR) {
+        report(1, "Only %d of %d hardware events can be counted", opened,
+               PERF_NR);
+    }
+}
+
+/* Execute command @next_cmd, NULL if unknown, with its final arguments */
+static bool dispatch_cmd(cmd_element_t *next_cmd, int argc, char *argv[])
 {
-    if (argc == 0)
-        return true;
-    /* Try to find matching command */
-    cmd_element_t *next_cmd = cmd_list;
     bool ok = true;
-    while (next_cmd && strcmp(argv[0], next_cmd->name) != 0)
-        next_cmd = next_cmd->next;
     if (next_cmd) {
+        for (int i = 0; i < cmd_hook_cnt; i++)
+            cmd_hooks[i](argc, argv);
+        /* Nested commands, as run by time, are counted as part of the
+         * outermost one
+         */
+        static int depth = 0;
+        uint64_t before[PERF_NR], after[PERF_NR];
+        bool counting = perf_enabled && !depth;
+        if (counting)
+            perf_read(before);
+
+        depth++;
+        uint64_t start = time_ns();
         ok = next_cmd->operation(argc, argv);
+        /* Commands are gone once quit ran */
+        if (!quit_flag)
+            record_latency(next_cmd, time_ns() - start);
+        depth--;
+
+        if (counting && perf_enabled) {
+            perf_read(after);
+            report_perf(before, after);
+        }
+        for (int i = 0; i < cmd_post_hook_cnt; i++)
+            cmd_post_hooks[i](argc, argv);
+        report_flush(false);
         if (!ok)
             record_error();
     } else {
@@ -190,22 +475,483 @@ static bool interpret_cmda(int argc, char *argv[])
     return ok;
 }
 
+/* Blocks, variables and macros.  The lines between "repeat N [var] {" or
+ * "define name {" and the matching "}" are not run as they are read, but
+ * collected into a block with the command of every line looked up once.  A
+ * repeated block then goes straight to the dispatch on every iteration,
+ * without its lines being parsed again.  Words refer to integer variables,
+ * as set by set, inc and repeat, as $name and to the arguments of the macro
+ * being run as $1 to $9.
+ */
+#define MAX_BLOCK_DEPTH 16
+#define MAX_MACRO_DEPTH 64
+#define MAX_VARS 64
+#define MAX_VAR_NAME 32
+
+#define VAR_CHARS \
+    "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ_0123456789"
+
+typedef struct __block block_t;
+
+/* A line of a block */
+typedef struct {
+    int argc;
+    char **argv;        /* Followed by the words in the same allocation */
+    size_t bytes;       /* Size of that allocation */
+    cmd_element_t *cmd; /* NULL for macros, unknown commands and blocks */
+    bool expand;        /* Whether words refer to variables or arguments */
+    block_t *body;      /* Block opened by the line, NULL if none */
+} stmt_t;
+
+struct __block {
+    stmt_t *stmts;
+    int count, size;
+};
+
+typedef struct {
+    char name[MAX_VAR_NAME];
+    int value;
+} var_t;
+
+/* Starts with its name to be kept in a name table */
+typedef struct {
+    char *name;
+    block_t *body;
+} macro_t;
+
+static var_t vars[MAX_VARS];
+static int var_cnt = 0;
+
+static name_table_t macro_table;
+static int macro_depth = 0;
+static int macro_argc = 0;
+static char **macro_argv = NULL;
+
+/* Blocks being collected, innermost last, and the line opening the first */
+static block_t *open_blocks[MAX_BLOCK_DEPTH];
+static int open_depth = 0;
+static stmt_t opener;
+/* Input file whose end closes the blocks still open */
+static rio_t *block_file;
+
+/* Number of blocks being run */
+static int exec_depth = 0;
+
+static void copy_stmt(stmt_t *s, int argc, char *argv[])
+{
+    size_t bytes = (argc + 1) * sizeof(char *);
+    for (int i = 0; i < argc; i++)
+        bytes += strlen(argv[i]) + 1;
+    s->argc = argc;
+    s->argv = malloc_or_fail(bytes, "copy_stmt");
+    s->bytes = bytes;
+    s->cmd = NULL;
+    s->expand = false;
+    s->body = NULL;
+
+    /* Comments are shown as written */
+    bool comment = !strcmp(argv[0], "#");
+    char *dst = (char *) (s->argv + argc + 1);
+    for (int i = 0; i < argc; i++) {
+        size_t len = strlen(argv[i]) + 1;
+        s->argv[i] = memcpy(dst, argv[i], len);
+        dst += len;
+        if (!comment && strchr(argv[i], '$'))
+            s->expand = true;
+    }
+    s->argv[argc] = NULL;
+}
+
+static block_t *new_block()
+{
+    block_t *b = malloc_or_fail(sizeof(block_t), "new_block");
+    b->stmts = NULL;
+    b->count = b->size = 0;
+    return b;
+}
+
+static void free_block_tree(block_t *b)
+{
+    for (int i = 0; i < b->count; i++) {
+        stmt_t *s = &b->stmts[i];
+        if (s->body)
+            free_block_tree(s->body);
+        free_block(s->argv, s->bytes);
+    }
+    if (b->stmts)
+        free_array(b->stmts, b->size, sizeof(stmt_t));
+    free_block(b, sizeof(block_t));
+}
+
+static stmt_t *add_stmt(block_t *b, int argc, char *argv[])
+{
+    if (b->count == b->size) {
+        int size = b->size ? 2 * b->size : 8;
+        stmt_t *stmts = calloc_or_fail(size, sizeof(stmt_t), "add_stmt");
+        if (b->stmts) {
+            memcpy(stmts, b->stmts, b->count * sizeof(stmt_t));
+            free_array(b->stmts, b->size, sizeof(stmt_t));
+        }
+        b->stmts = stmts;
+        b->size = size;
+    }
+    stmt_t *s = &b->stmts[b->count++];
+    copy_stmt(s, argc, argv);
+    return s;
+}
+
+static var_t *find_var(const char *name, size_t len)
+{
+    for (int i = 0; i < var_cnt; i++) {
+        if (!strncmp(vars[i].name, name, len) && !vars[i].name[len])
+            return &vars[i];
+    }
+    return NULL;
+}
+
+/* Variable called @name, created with value 0 if new */
+static var_t *get_var(const char *name)
+{
+    size_t len = strlen(name);
+    var_t *v = find_var(name, len);
+    if (v)
+        return v;
+    if (!len || len >= MAX_VAR_NAME || isdigit((unsigned char) *name) ||
+        strspn(name, VAR_CHARS) != len) {
+        report(1, "Invalid variable name '%s'", name);
+        return NULL;
+    }
+    if (var_cnt == MAX_VARS) {
+        report(1, "Cannot have more than %d variables", MAX_VARS);
+        return NULL;
+    }
+    v = &vars[var_cnt++];
+    strcpy(v->name, name);
+    v->value = 0;
+    return v;
+}
+
+/* Write @word with its references replaced by their values into @dst, or
+ * only measure the result if @dst is NULL.
+ *
+ * Return: length of the result, -1 if a reference cannot be resolved
+ */
+static ssize_t expand_word(const char *word, char *dst)
+{
+    size_t len = 0;
+    const char *p = word;
+    while (*p) {
+        char num[16];
+        const char *val = p;
+        size_t n;
+        if (*p != '$') {
+            n = strcspn(p, "$");
+            p += n;
+        } else if (isdigit((unsigned char) p[1])) {
+            int k = p[1] - '0';
+            if (k >= macro_argc) {
+                report(1, "No macro argument $%d", k);
+                return -1;
+            }
+            val = macro_argv[k];
+            n = strlen(val);
+            p += 2;
+        } else if ((n = strspn(p + 1, VAR_CHARS))) {
+            var_t *v = find_var(p + 1, n);
+            if (!v) {
+                report(1, "Unknown variable '$%.*s'", (int) n, p + 1);
+                return -1;
+            }
+            p += n + 1;
+            n = snprintf(num, sizeof(num), "%d", v->value);
+            val = num;
+        } else {
+            /* A '$' referring to nothing stands for itself */
+            n = 1;
+            p++;
+        }
+        if (dst)
+            memcpy(dst + len, val, n);
+        len += n;
+    }
+    if (dst)
+        dst[len] = '\0';
+    return len;
+}
+
+/* Replace the references in the words of @argv into @cl */
+static bool expand_args(int argc, char *argv[], cmdline_t *cl)
+{
+    size_t bytes = 0;
+    for (int i = 0; i < argc; i++) {
+        ssize_t len = expand_word(argv[i], NULL);
+        if (len < 0)
+            return false;
+        bytes += len + 1;
+    }
+
+    reserve_args(argc + 1 + (bytes + sizeof(char *) - 1) / sizeof(char *), cl);
+    char *dst = (char *) (cl->argv + argc + 1);
+    for (int i = 0; i < argc; i++) {
+        cl->argv[i] = dst;
+        dst += expand_word(argv[i], dst) + 1;
+    }
+    cl->argv[argc] = NULL;
+    cl->argc = argc;
+    return true;
+}
+
+static bool exec_block(const block_t *b);
+
+static bool call_macro(macro_t *m, int argc, char *argv[])
+{
+    if (macro_depth == MAX_MACRO_DEPTH) {
+        report(1, "Macros nested deeper than %d", MAX_MACRO_DEPTH);
+        record_error();
+        return false;
+    }
+
+    int saved_argc = macro_argc;
+    char **saved_argv = macro_argv;
+    macro_argc = argc;
+    macro_argv = argv;
+    macro_depth++;
+    exec_depth++;
+    bool ok = exec_block(m->body);
+    exec_depth--;
+    macro_depth--;
+    macro_argc = saved_argc;
+    macro_argv = saved_argv;
+    return ok;
+}
+
+/* Run a line whose words are final: a command, a macro or neither */
+static bool run_words(cmd_element_t *cmd, int argc, char *argv[])
+{
+    if (!cmd) {
+        macro_t *m = table_find(&macro_table, argv[0]);
+        if (m)
+            return call_macro(m, argc, argv);
+    }
+    return dispatch_cmd(cmd, argc, argv);
+}
+
+/* Run @body as many times as "repeat N [var] {" in @argv says */
+static bool run_repeat(int argc, char *argv[], const block_t *body)
+{
+    int n;
+    var_t *v = NULL;
+    if (argc > 4 || !get_int(argv[1], &n) || n < 0) {
+        report(1, "Usage: repeat N [var] {");
+        record_error();
+        return false;
+    }
+    if (argc == 4 && !(v = get_var(argv[2]))) {
+        record_error();
+        return false;
+    }
+
+    bool ok = true;
+    exec_depth++;
+    for (int i = 0; i < n && !quit_flag; i++) {
+        if (v)
+            v->value = i;
+        ok = exec_block(body) && ok;
+    }
+    exec_depth--;
+    return ok;
+}
+
+static bool exec_stmt(const stmt_t *s,
+                      cmd_element_t *cmd,
+                      int argc,
+                      char *argv[])
+{
+    if (!s->body)
+        return run_words(cmd, argc, argv);
+    if (!strcmp(argv[0], "repeat"))
+        return run_repeat(argc, argv, s->body);
+    /* Any other block was reported when collected */
+    return false;
+}
+
+static bool exec_block(const block_t *b)
+{
+    bool ok = true;
+    /* Quitting releases macros, possibly including @b */
+    for (int i = 0; !quit_flag && i < b->count; i++) {
+        const stmt_t *s = &b->stmts[i];
+        if (!s->expand) {
+            ok = exec_stmt(s, s->cmd, s->argc, s->argv) && ok;
+            continue;
+        }
+
+        cmdline_t cl;
+        if (!expand_args(s->argc, s->argv, &cl)) {
+            record_error();
+            ok = false;
+            continue;
+        }
+        cmd_element_t *cmd = s->cmd;
+        if (!cmd && !s->body)
+            cmd = table_find(&cmd_table, cl.argv[0]);
+        ok = exec_stmt(s, cmd, cl.argc, cl.argv) && ok;
+        release_args(&cl);
+    }
+    return ok;
+}
+
+static void define_macro(const char *name, block_t *body)
+{
+    macro_t *m = table_find(&macro_table, name);
+    if (m) {
+        free_block_tree(m->body);
+        m->body = body;
+        return;
+    }
+    m = malloc_or_fail(sizeof(macro_t), "define_macro");
+    m->name = strsave_or_fail(name, "define_macro");
+    m->body = body;
+    table_add(&macro_table, m);
+}
+
+static void free_macros()
+{
+    for (size_t i = 0; i < macro_table.nslots; i++) {
+        macro_t *m = macro_table.slots[i];
+        if (!m)
+            continue;
+        free_block_tree(m->body);
+        free_string(m->name);
+        free_block(m, sizeof(macro_t));
+    }
+    table_clear(&macro_table);
+}
+
+/* Start collecting the block opened by the line @argv */
+static void open_block(int argc, char *argv[])
+{
+    copy_stmt(&opener, argc, argv);
+    block_file = buf_stack;
+    open_blocks[0] = new_block();
+    open_depth = 1;
+}
+
+static void discard_blocks()
+{
+    if (!open_depth)
+        return;
+    free_block_tree(open_blocks[0]);
+    free_block(opener.argv, opener.bytes);
+    open_depth = 0;
+}
+
+static bool is_opener(int argc, char *argv[])
+{
+    return argc >= 3 && !strcmp(argv[argc - 1], "{") &&
+           (!strcmp(argv[0], "repeat") || !strcmp(argv[0], "define"));
+}
+
+/* Add a line to the innermost block being collected.  The "}" closing the
+ * outermost one defines the macro or runs the repeated block.
+ */
+static bool collect(int argc, char *argv[])
+{
+    if (argc == 1 && !strcmp(argv[0], "}")) {
+        if (--open_depth)
+            return true;
+
+        bool ok = true;
+        if (!strcmp(opener.argv[0], "define")) {
+            define_macro(opener.argv[1], open_blocks[0]);
+        } else {
+            ok = run_repeat(opener.argc, opener.argv, open_blocks[0]);
+            free_block_tree(open_blocks[0]);
+        }
+        free_block(opener.argv, opener.bytes);
+        return ok;
+    }
+
+    bool opens = is_opener(argc, argv);
+    if (opens && open_depth == MAX_BLOCK_DEPTH) {
+        report(1, "Blocks nested deeper than %d", MAX_BLOCK_DEPTH);
+        discard_blocks();
+        record_error();
+        return false;
+    }
+
+    stmt_t *s = add_stmt(open_blocks[open_depth - 1], argc, argv);
+    if (opens) {
+        /* Collected all the same, so that braces still match */
+        s->body = new_block();
+        open_blocks[open_depth++] = s->body;
+        if (strcmp(argv[0], "repeat")) {
+            report(1, "Only repeat blocks can be nested");
+            record_error();
+            return false;
+        }
+    } else if (!strchr(argv[0], '$')) {
+        s->cmd = table_find(&cmd_table, argv[0]);
+    }
+    return true;
+}
+
+/* Execute a line read or replayed, @next_cmd being the command it names.
+ * While a block is open the line is only collected.
+ */
+static bool run_cmd(cmd_element_t *next_cmd, int argc, char *argv[])
+{
+    if (open_depth)
+        return collect(argc, argv);
+
+    bool expand = false;
+    if (strcmp(argv[0], "#")) {
+        for (int i = 0; i < argc && !expand; i++)
+            expand = strchr(argv[i], '$');
+    }
+    if (!expand)
+        return run_words(next_cmd, argc, argv);
+
+    cmdline_t cl;
+    if (!expand_args(argc, argv, &cl)) {
+        record_error();
+        return false;
+    }
+    if (strchr(argv[0], '$'))
+        next_cmd = table_find(&cmd_table, cl.argv[0]);
+    bool ok = run_words(next_cmd, cl.argc, cl.argv);
+    release_args(&cl);
+    return ok;
+}
+
+/* Execute a command that has already been split into arguments */
+static bool interpret_cmda(int argc, char *argv[])
+{
+    if (argc == 0)
+        return true;
+    /* Try to find matching command */
+    return run_cmd(table_find(&cmd_table, argv[0]), argc, argv);
+}
+
 /* Execute a command from a command line */
-static bool interpret_cmd(char *cmdline)
+static bool interpret_line(const char *line, size_t len)
 {
     if (quit_flag)
         return false;
 
-    int argc;
-    char **argv = parse_args(cmdline, &argc);
-    bool ok = interpret_cmda(argc, argv);
-    for (int i = 0; i < argc; i++)
-        free_string(argv[i]);
-    free_array(argv, argc, sizeof(char *));
+    cmdline_t cl;
+    parse_args(line, len, &cl);
+    bool ok = interpret_cmda(cl.argc, cl.argv);
+    release_args(&cl);
 
     return ok;
 }
 
+static bool interpret_cmd(char *cmdline)
+{
+    return interpret_line(cmdline, strlen(cmdline));
+}
+
 /* Set function to be executed as part of program exit */
 void add_quit_helper(cmd_func_t qf)
 {
@@ -215,6 +961,24 @@ void add_quit_helper(cmd_func_t qf)
         report_event(MSG_FATAL, "Exceeded limit on quit helpers");
 }
 
+/* Set function to be executed before every command */
+void add_cmd_hook(cmd_hook_t hook)
+{
+    if (cmd_hook_cnt < MAXHOOK)
+        cmd_hooks[cmd_hook_cnt++] = hook;
+    else
+        report_event(MSG_FATAL, "Exceeded limit on command hooks");
+}
+
+/* Set function to be executed after every command */
+void add_cmd_post_hook(cmd_hook_t hook)
+{
+    if (cmd_post_hook_cnt < MAXHOOK)
+        cmd_post_hooks[cmd_post_hook_cnt++] = hook;
+    else
+        report_event(MSG_FATAL, "Exceeded limit on command hooks");
+}
+
 /* Turn echoing on/off */
 void set_echo(bool on)
 {
@@ -229,6 +993,7 @@ static bool do_quit(int argc, char *argv[])
     while (c) {
         cmd_element_t *ele = c;
         c = c->next;
+        free(ele->latency);
         free_block(ele, sizeof(cmd_element_t));
     }
 
@@ -239,6 +1004,11 @@ static bool do_quit(int argc, char *argv[])
         free_block(ele, sizeof(param_element_t));
     }
 
+    table_clear(&cmd_table);
+    table_clear(&param_table);
+    free_macros();
+    discard_blocks();
+
     while (buf_stack)
         pop_file();
 
@@ -320,17 +1090,13 @@ static bool do_option(int argc, char *argv[])
             report(1, "Cannot parse '%s' as integer", argv[i]);
             return false;
         }
-        /* Find parameter in list */
-        param_element_t *plist = param_list;
-        while (!found && plist) {
-            if (strcmp(plist->name, name) == 0) {
-                int oldval = *plist->valp;
-                *plist->valp = value;
-                if (plist->setter)
-                    plist->setter(oldval);
-                found = true;
-            } else
-                plist = plist->next;
+        param_element_t *param = table_find(&param_table, name);
+        if (param) {
+            int oldval = *param->valp;
+            *param->valp = value;
+            if (param->setter)
+                param->setter(oldval);
+            found = true;
         }
         /* Didn't find parameter */
         if (!found) {
@@ -377,20 +1143,357 @@ static bool do_time(int argc, char *argv[])
     bool ok = true;
     if (argc <= 1) {
         double elapsed = last_time - first_time;
-        report(1, "Elapsed time = %.3f, Delta time = %.3f", elapsed, delta);
+        report(1, "Elapsed time = %.3f, Delta time = %.6f", elapsed, delta);
     } else {
         ok = interpret_cmda(argc - 1, argv + 1);
         if (block_flag) {
             block_timing = true;
         } else {
             delta = delta_time(&last_time);
-            report(1, "Delta time = %.3f", delta);
+            report(1, "Delta time = %.6f", delta);
+        }
+    }
+
+    return ok;
+}
+
+/* Run a command that is expected to fail, without counting its errors.  A
+ * file it sources is read to its end here.
+ */
+static bool do_fail(int argc, char *argv[])
+{
+    if (argc < 2) {
+        report(1, "%s takes a command to run", argv[0]);
+        return false;
+    }
+
+    int errors = err_cnt;
+    rio_t *outer = buf_stack;
+    bool failed = !interpret_cmda(argc - 1, argv + 1);
+    while (buf_stack != outer && !quit_flag) {
+        size_t len;
+        const char *line = readline(&len);
+        if (line)
+            interpret_line(line, len);
+    }
+    if (quit_flag)
+        return false;
+
+    failed = failed || err_cnt > errors;
+    err_cnt = errors;
+    if (!failed) {
+        report(1, "ERROR: '%s' did not fail", argv[1]);
+        return false;
+    }
+    return true;
+}
+
+static bool do_repeat(int argc, char *argv[])
+{
+    int n;
+    if (argc < 3 || !get_int(argv[1], &n) || n < 0) {
+        report(1, "Usage: repeat N cmd arg ... or repeat N [var] {");
+        return false;
+    }
+
+    if (!strcmp(argv[argc - 1], "{")) {
+        if (argc > 4) {
+            report(1, "Usage: repeat N [var] {");
+            return false;
         }
+        if (exec_depth) {
+            report(1, "Blocks cannot be opened while a block runs");
+            return false;
+        }
+        if (argc == 4 && !get_var(argv[2]))
+            return false;
+        open_block(argc, argv);
+        return true;
     }
 
+    cmd_element_t *cmd = table_find(&cmd_table, argv[2]);
+    bool ok = true;
+    for (int i = 0; i < n && !quit_flag; i++)
+        ok = run_words(cmd, argc - 2, argv + 2) && ok;
     return ok;
 }
 
+static bool do_define(int argc, char *argv[])
+{
+    if (argc != 3 || strcmp(argv[2], "{")) {
+        report(1, "Usage: define name {");
+        return false;
+    }
+    if (exec_depth) {
+        report(1, "Blocks cannot be opened while a block runs");
+        return false;
+    }
+    if (table_find(&cmd_table, argv[1])) {
+        report(1, "Cannot redefine command '%s'", argv[1]);
+        return false;
+    }
+    open_block(argc, argv);
+    return true;
+}
+
+static bool do_set(int argc, char *argv[])
+{
+    if (argc == 1) {
+        for (int i = 0; i < var_cnt; i++)
+            report(1, "  %-12s%d", vars[i].name, vars[i].value);
+        return true;
+    }
+
+    int value;
+    if (argc != 3) {
+        report(1, "%s takes a variable name and a value", argv[0]);
+        return false;
+    }
+    if (!get_int(argv[2], &value)) {
+        report(1, "Cannot parse '%s' as integer", argv[2]);
+        return false;
+    }
+    var_t *v = get_var(argv[1]);
+    if (!v)
+        return false;
+    v->value = value;
+    return true;
+}
+
+static bool do_inc(int argc, char *argv[])
+{
+    int delta = 1;
+    if (argc < 2 || argc > 3) {
+        report(1, "%s takes a variable name and an optional amount", argv[0]);
+        return false;
+    }
+    if (argc == 3 && !get_int(argv[2], &delta)) {
+        report(1, "Cannot parse '%s' as integer", argv[2]);
+        return false;
+    }
+    var_t *v = get_var(argv[1]);
+    if (!v)
+        return false;
+    v->value = (int) ((unsigned) v->value + delta);
+    return true;
+}
+
+static bool do_latency(int argc, char *argv[])
+{
+    bool reset = argc == 2 && !strcmp(argv[1], "reset");
+    if (argc > 2 || (argc == 2 && !reset)) {
+        report(1, "%s takes no arguments but 'reset'", argv[0]);
+        return false;
+    }
+
+    if (!reset)
+        report(1, "%-12s %10s %12s %12s %12s %12s %12s", "command", "count",
+               "min us", "p50 us", "p99 us", "p999 us", "max us");
+    for (cmd_element_t *c = cmd_list; c; c = c->next) {
+        latency_t *lat = c->latency;
+        if (!lat)
+            continue;
+        if (reset) {
+            free(lat);
+            c->latency = NULL;
+            continue;
+        }
+        report(1, "%-12s %10lu %12.3f %12.3f %12.3f %12.3f %12.3f", c->name,
+               (unsigned long) lat->count, lat->min * 1e-3,
+               latency_quantile(lat, 0.5) * 1e-3,
+               latency_quantile(lat, 0.99) * 1e-3,
+               latency_quantile(lat, 0.999) * 1e-3, lat->max * 1e-3);
+    }
+    return true;
+}
+
+/* Run the commands of @script, separated by ';' and with ',' in place of
+ * spaces, so that a script is a single argument of bench
+ */
+static bool run_script(const char *script)
+{
+    if (!script)
+        return true;
+
+    char *buf = strsave_or_fail(script, "run_script");
+    for (char *p = buf; *p; p++) {
+        if (*p == ',')
+            *p = ' ';
+    }
+    bool ok = true;
+    char *save = NULL;
+    for (char *line = strtok_r(buf, ";", &save); ok && line;
+         line = strtok_r(NULL, ";", &save))
+        ok = interpret_cmd(line);
+    free_string(buf);
+    return ok;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+    return (x > y) - (x < y);
+}
+
+/* Two-sided 95% quantile of Student's t distribution, by degrees of freedom
+ */
+static double t95(int df)
+{
+    static const double t[] = {
+        12.706, 4.303, 3.182, 2.776, 2.571, 2.447, 2.365, 2.306,
+        2.262,  2.228, 2.201, 2.179, 2.160, 2.145, 2.131, 2.120,
+        2.110,  2.101, 2.093, 2.086, 2.080, 2.074, 2.069, 2.064,
+        2.060,  2.056, 2.052, 2.048, 2.045, 2.042,
+    };
+    if (df < 1)
+        return 0;
+    return df <= (int) (sizeof(t) / sizeof(t[0])) ? t[df - 1] : 1.960;
+}
+
+/* Write @s without the quotes of a JSON string */
+static void put_json(const char *s, FILE *f)
+{
+    for (; s && *s; s++) {
+        if (*s == '"' || *s == '\\')
+            fputc('\\', f);
+        fputc(*s, f);
+    }
+}
+
+/* Append the statistics as a JSON line to @file_name */
+static bool append_bench(const char *file_name,
+                         int argc,
+                         char *argv[],
+                         const char *setup,
+                         const char *teardown,
+                         int runs,
+                         int warmup,
+                         const double *stats)
+{
+    FILE *f = fopen(file_name, "a");
+    if (!f)
+        return false;
+
+    fprintf(f, "{\"time\": %ld, \"cmd\": \"", (long) time(NULL));
+    for (int i = 0; i < argc; i++) {
+        if (i)
+            fputc(' ', f);
+        put_json(argv[i], f);
+    }
+    fputs("\", \"setup\": \"", f);
+    put_json(setup, f);
+    fputs("\", \"teardown\": \"", f);
+    put_json(teardown, f);
+    fprintf(f,
+            "\", \"runs\": %d, \"warmup\": %d, \"mean_us\": %.3f, "
+            "\"stddev_us\": %.3f, \"median_us\": %.3f, \"ci95_low_us\": %.3f, "
+            "\"ci95_high_us\": %.3f, \"min_us\": %.3f, \"max_us\": %.3f}\n",
+            runs, warmup, stats[0], stats[1], stats[2], stats[3], stats[4],
+            stats[5], stats[6]);
+    return !fclose(f);
+}
+
+static bool do_bench(int argc, char *argv[])
+{
+    int warmup = 0, runs = 0;
+    char *setup = NULL, *teardown = NULL, *out = NULL;
+    int i = 1;
+    for (; i + 1 < argc && argv[i][0] == '-' && strlen(argv[i]) == 2; i += 2) {
+        char *val = argv[i + 1];
+        switch (argv[i][1]) {
+        case 'w':
+            if (!get_int(val, &warmup) || warmup < 0) {
+                report(1, "Invalid warmup count '%s'", val);
+                return false;
+            }
+            break;
+        case 's':
+            setup = val;
+            break;
+        case 't':
+            teardown = val;
+            break;
+        case 'o':
+            out = val;
+            break;
+        default:
+            report(1, "Unknown bench flag '%s'", argv[i]);
+            return false;
+        }
+    }
+    if (i + 1 >= argc || !get_int(argv[i], &runs) || runs < 1) {
+        report(1,
+               "Usage: %s [-w warmup] [-s setup] [-t teardown] [-o file] "
+               "N cmd arg ...",
+               argv[0]);
+        return false;
+    }
+    int cmd_argc = argc - i - 1;
+    char **cmd_argv = argv + i + 1;
+
+    /* The queue is not shown after every run, which could take longer than
+     * the command itself.  Warnings and errors still are.
+     */
+    int saved_verblevel = verblevel;
+    if (verblevel > 2)
+        verblevel = 2;
+
+    uint64_t *samples = malloc_or_fail(runs * sizeof(uint64_t), "do_bench");
+    bool ok = true;
+    for (int k = 0; ok && k < warmup + runs; k++) {
+        ok = run_script(setup);
+        if (!ok)
+            break;
+        uint64_t start = time_ns();
+        ok = interpret_cmda(cmd_argc, cmd_argv);
+        uint64_t ns = time_ns() - start;
+        ok = run_script(teardown) && ok;
+        if (k >= warmup)
+            samples[k - warmup] = ns;
+    }
+    verblevel = saved_verblevel;
+    if (!ok) {
+        report(1, "Benchmark of '%s' stopped by an error", cmd_argv[0]);
+        free_array(samples, runs, sizeof(uint64_t));
+        return false;
+    }
+
+    double sum = 0, sq = 0;
+    for (int k = 0; k < runs; k++)
+        sum += samples[k] * 1e-3;
+    double mean = sum / runs;
+    for (int k = 0; k < runs; k++) {
+        double d = samples[k] * 1e-3 - mean;
+        sq += d * d;
+    }
+    double stddev = runs > 1 ? sqrt(sq / (runs - 1)) : 0;
+    double half = t95(runs - 1) * stddev / sqrt(runs);
+    qsort(samples, runs, sizeof(uint64_t), cmp_u64);
+    double median = (samples[(runs - 1) / 2] + samples[runs / 2]) * 0.5e-3;
+    double stats[] = {mean,
+                      stddev,
+                      median,
+                      mean - half,
+                      mean + half,
+                      samples[0] * 1e-3,
+                      samples[runs - 1] * 1e-3};
+    free_array(samples, runs, sizeof(uint64_t));
+
+    report(1, "%s: %d runs after %d warmup", cmd_argv[0], runs, warmup);
+    report(1,
+           "  mean = %.3f us, stddev = %.3f us, median = %.3f us, "
+           "95%% CI = [%.3f, %.3f] us, min = %.3f us, max = %.3f us",
+           stats[0], stats[1], stats[2], stats[3], stats[4], stats[5],
+           stats[6]);
+
+    if (out && !append_bench(out, cmd_argc, cmd_argv, setup, teardown, runs,
+                             warmup, stats)) {
+        report(1, "Couldn't append results to '%s'", out);
+        return false;
+    }
+    return true;
+}
+
 static bool use_linenoise = true;
 static int web_fd;
 
@@ -404,6 +1507,7 @@ static bool do_web(int argc, char *argv[])
 
     web_fd = web_open(port);
     if (web_fd > 0) {
+        report_flush(true);
         printf("listen on port %d, fd is %d\n", port, web_fd);
         line_set_eventmux_callback(web_eventmux);
         use_linenoise = false;
@@ -422,13 +1526,34 @@ void init_cmd()
     err_cnt = 0;
     quit_flag = false;
 
+    ADD_COMMAND(bench,
+                "Run command N times and show its timing statistics.  Scripts "
+                "of setup and teardown commands use ';' between commands and "
+                "',' for spaces",
+                "[-w warmup] [-s setup] [-t teardown] [-o file] N cmd arg ...");
+    ADD_COMMAND(define,
+                "Define a macro of the lines up to '}', run by its name with "
+                "arguments $1 to $9",
+                "name {");
+    ADD_COMMAND(fail, "Run command that must fail, without counting its errors",
+                "cmd arg ...");
     ADD_COMMAND(help, "Show summary", "");
     ADD_COMMAND(option,
                 "Display or set options. See 'Options' section for details",
                 "[name val]");
     ADD_COMMAND(quit, "Exit program", "");
+    ADD_COMMAND(repeat,
+                "Run command N times, or the lines up to '}' with var "
+                "counting from 0",
+                "N cmd arg ... | N [var] {");
+    ADD_COMMAND(set, "Show variables or set one, used as $name", "[name val]");
+    ADD_COMMAND(inc, "Add to a variable", "name [delta]");
     ADD_COMMAND(source, "Read commands from source file", "");
     ADD_COMMAND(log, "Copy output to file", "file");
+    ADD_COMMAND(latency,
+                "Show latency percentiles of every command run so far, or "
+                "reset them",
+                "[reset]");
     ADD_COMMAND(time, "Time command execution", "cmd arg ...");
     ADD_COMMAND(web, "Read commands from builtin web server", "[port]");
     add_cmd("#", do_comment_cmd, "Display comment", "...");
@@ -437,6 +1562,10 @@ void init_cmd()
     add_param("error", &err_limit, "Number of errors until exit", NULL);
     add_param("echo", &echo, "Do/don't echo commands", NULL);
     add_param("entropy", &show_entropy, "Show/Hide Shannon entropy", NULL);
+    add_param("perf", &perf_enabled,
+              "Count cycles, instructions and cache, branch and TLB misses of "
+              "every command",
+              perf_setter);
 
     init_in();
     init_time(&last_time);
@@ -457,10 +1586,25 @@ static bool push_file(char *fname)
     if (fd > fd_max)
         fd_max = fd;
 
-    rio_t *rnew = malloc_or_fail(sizeof(rio_t), "push_file");
+    char *map = NULL;
+    struct stat st;
+    if (fname && !fstat(fd, &st) && S_ISREG(st.st_mode) && st.st_size > 0) {
+        map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map == MAP_FAILED)
+            map = NULL;
+        else
+            madvise(map, st.st_size, MADV_SEQUENTIAL);
+    }
+
+    rio_t *rnew = malloc_or_fail(sizeof(rio_t) + (map ? 0 : RIO_BUFSIZE),
+                                 "push_file");
     rnew->fd = fd;
-    rnew->count = 0;
-    rnew->bufptr = rnew->buf;
+    rnew->map = map;
+    rnew->map_size = map ? st.st_size : 0;
+    rnew->count = rnew->map_size;
+    rnew->bufptr = map ? map : rnew->buf;
+    rnew->name = fname ? strsave_or_fail(fname, "push_file") : NULL;
+    rnew->line = 0;
     rnew->prev = buf_stack;
     buf_stack = rnew;
 
@@ -473,8 +1617,15 @@ static void pop_file()
     if (buf_stack) {
         rio_t *rsave = buf_stack;
         buf_stack = rsave->prev;
+        if (rsave->map)
+            munmap(rsave->map, rsave->map_size);
+        if (rsave->name) {
+            if (cur_file == rsave->name)
+                cur_file = NULL;
+            free_string(rsave->name);
+        }
         close(rsave->fd);
-        free_block(rsave, sizeof(rio_t));
+        free_block(rsave, sizeof(rio_t) + (rsave->map ? 0 : RIO_BUFSIZE));
     }
 }
 
@@ -484,60 +1635,59 @@ static void init_in()
     buf_stack = NULL;
 }
 
-/* Read command from input file.
- * When hit EOF, close that file and return NULL
+/* Read command from input file.  The line is left in place, without its
+ * newline, and stays valid until the next call.  A line longer than the
+ * internal buffer is cut.  When hit EOF, close that file and return NULL.
  */
-static char *readline()
+static const char *readline(size_t *lenp)
 {
-    char c;
-    char *lptr = linebuf;
-
-    if (!buf_stack)
+    rio_t *rio = buf_stack;
+    if (!rio)
         return NULL;
 
-    for (int cnt = 0; cnt < RIO_BUFSIZE - 2; cnt++) {
-        if (buf_stack->count <= 0) {
-            /* Need to read from input file */
-            buf_stack->count = read(buf_stack->fd, buf_stack->buf, RIO_BUFSIZE);
-            buf_stack->bufptr = buf_stack->buf;
-            if (buf_stack->count <= 0) {
-                /* Encountered EOF */
-                pop_file();
-                if (cnt > 0) {
-                    /* Last line of file did not terminate with newline. */
-                    /*  Terminate line & return it */
-                    *lptr++ = '\n';
-                    *lptr++ = '\0';
-                    if (echo) {
-                        report_noreturn(1, prompt);
-                        report_noreturn(1, linebuf);
-                    }
-                    return linebuf;
-                }
-                return NULL;
-            }
+    char *nl = memchr(rio->bufptr, '\n', rio->count);
+    if (!nl && !rio->map) {
+        /* Move the partial line to the front and fill the buffer behind it */
+        memmove(rio->buf, rio->bufptr, rio->count);
+        rio->bufptr = rio->buf;
+        while (!nl && rio->count < RIO_BUFSIZE) {
+            ssize_t n = read(rio->fd, rio->buf + rio->count,
+                             RIO_BUFSIZE - rio->count);
+            if (n <= 0)
+                break;
+            nl = memchr(rio->buf + rio->count, '\n', n);
+            rio->count += n;
         }
-
-        /* Have text in buffer */
-        c = *buf_stack->bufptr++;
-        *lptr++ = c;
-        buf_stack->count--;
-        if (c == '\n')
-            break;
     }
 
-    if (c != '\n') {
-        /* Hit buffer limit.  Artificially terminate line */
-        *lptr++ = '\n';
+    if (!rio->count) {
+        /* Encountered EOF */
+        if (open_depth && block_file == rio) {
+            report(1, "Missing '}' at end of %s",
+                   rio->name ? rio->name : "input");
+            record_error();
+            discard_blocks();
+        }
+        pop_file();
+        return NULL;
     }
-    *lptr++ = '\0';
+
+    /* Without a newline, the line is the last of the file or too long */
+    const char *line = rio->bufptr;
+    size_t len = nl ? (size_t) (nl - line) : rio->count;
+    size_t used = nl ? len + 1 : len;
+    rio->bufptr += used;
+    rio->count -= used;
+    cur_file = rio->name;
+    cur_line = ++rio->line;
 
     if (echo) {
         report_noreturn(1, prompt);
-        report_noreturn(1, linebuf);
+        report_noreturn(1, "%.*s\n", (int) len, line);
     }
 
-    return linebuf;
+    *lenp = len;
+    return line;
 }
 
 static bool cmd_done()
@@ -582,15 +1732,18 @@ static int cmd_select(int nfds,
             FD_SET(web_fd, readfds);
 
         if (infd == STDIN_FILENO && prompt_flag) {
+            report_flush(true);
             char *cmdline = linenoise(prompt);
+            cur_file = NULL;
             if (cmdline)
                 interpret_cmd(cmdline);
             fflush(stdout);
             prompt_flag = true;
         } else if (infd != STDIN_FILENO) {
-            char *cmdline = readline();
-            if (cmdline)
-                interpret_cmd(cmdline);
+            size_t len;
+            const char *line = readline(&len);
+            if (line)
+                interpret_line(line, len);
         }
     }
     return 0;
@@ -599,6 +1752,11 @@ static int cmd_select(int nfds,
 bool finish_cmd()
 {
     bool ok = true;
+    if (open_depth) {
+        report(1, "Missing '}' at end of input");
+        record_error();
+        discard_blocks();
+    }
     if (!quit_flag)
         ok = ok && do_quit(0, NULL);
     has_infile = false;
@@ -655,7 +1813,11 @@ bool run_console(char *infile_name)
 
     if (!has_infile) {
         char *cmdline;
-        while (use_linenoise && (cmdline = linenoise(prompt))) {
+        while (use_linenoise) {
+            report_flush(true);
+            if (!(cmdline = linenoise(prompt)))
+                break;
+            cur_file = NULL;
             interpret_cmd(cmdline);
             line_history_add(cmdline);       /* Add to the history. */
             line_history_save(HISTORY_FILE); /* Save the history on disk. */
@@ -675,3 +1837,262 @@ bool run_console(char *infile_name)
 
     return err_cnt == 0;
 }
+
+/* Compiled command files hold the command lines of a text file already split
+ * into arguments, with command names replaced by indices into a table of the
+ * names used, so that replaying them involves no parsing.  Lines keep their
+ * numbers for error messages, and their text to be echoed as it was.  All
+ * numbers are 32-bit in native byte order:
+ *
+ *   header: QTB_MAGIC, number of names, number of lines, offset of names,
+ *           source file name
+ *   lines:  line number, text without the newline, index of name, argc, then
+ *           every argument past the command name.  Blank lines have an argc
+ *           of 0, only to be echoed.
+ *   names:  every name
+ *
+ * A string is its length followed by its bytes and a null character.
+ */
+#define QTB_MAGIC "QTB2"
+
+typedef struct {
+    char **names;
+    uint32_t count, size;
+} qtb_names_t;
+
+static bool put_u32(FILE *f, uint32_t v)
+{
+    return fwrite(&v, sizeof(v), 1, f) == 1;
+}
+
+static bool put_str(FILE *f, const char *s)
+{
+    uint32_t len = strlen(s);
+    return put_u32(f, len) && fwrite(s, 1, len + 1, f) == len + 1;
+}
+
+static bool qtb_has_name(const qtb_names_t *t, const char *name)
+{
+    for (uint32_t i = 0; i < t->count; i++) {
+        if (!strcmp(t->names[i], name))
+            return true;
+    }
+    return false;
+}
+
+static void qtb_free_names(qtb_names_t *t)
+{
+    for (uint32_t i = 0; i < t->count; i++)
+        free_string(t->names[i]);
+    if (t->names)
+        free_array(t->names, t->size, sizeof(char *));
+}
+
+/* Index of @name in @t, added if not seen yet */
+static uint32_t qtb_name_index(qtb_names_t *t, const char *name)
+{
+    for (uint32_t i = 0; i < t->count; i++) {
+        if (!strcmp(t->names[i], name))
+            return i;
+    }
+    if (t->count == t->size) {
+        uint32_t size = t->size ? 2 * t->size : 32;
+        char **names = calloc_or_fail(size, sizeof(char *), "qtb_name_index");
+        if (t->names) {
+            memcpy(names, t->names, t->count * sizeof(char *));
+            free_array(t->names, t->size, sizeof(char *));
+        }
+        t->names = names;
+        t->size = size;
+    }
+    t->names[t->count] = strsave_or_fail(name, "qtb_name_index");
+    return t->count++;
+}
+
+bool compile_cmd_file(const char *in_name, const char *out_name)
+{
+    FILE *in = fopen(in_name, "r");
+    if (!in) {
+        report(1, "Could not open source file '%s'", in_name);
+        return false;
+    }
+    FILE *out = fopen(out_name, "wb");
+    if (!out) {
+        report(1, "Could not create compiled file '%s'", out_name);
+        fclose(in);
+        return false;
+    }
+
+    /* Counts and offset are filled in at the end */
+    bool ok = fwrite(QTB_MAGIC, 4, 1, out) == 1 && put_u32(out, 0) &&
+              put_u32(out, 0) && put_u32(out, 0) && put_str(out, in_name);
+
+    qtb_names_t names = {NULL, 0, 0}, macros = {NULL, 0, 0};
+    uint32_t nlines = 0;
+    char *line = NULL;
+    size_t size = 0;
+    ssize_t len;
+    for (int lineno = 1; ok && (len = getline(&line, &size, in)) >= 0;
+         lineno++) {
+        cmdline_t cl;
+        parse_args(line, len, &cl);
+        /* Macros are only known to be defined earlier in the file */
+        if (cl.argc == 3 && !strcmp(cl.argv[0], "define"))
+            qtb_name_index(&macros, cl.argv[1]);
+        else if (cl.argc && !table_find(&cmd_table, cl.argv[0]) &&
+                 strcmp(cl.argv[0], "}") && !qtb_has_name(&macros, cl.argv[0]))
+            report(1, "Warning: unknown command '%s' at %s:%d", cl.argv[0],
+                   in_name, lineno);
+        if (len && line[len - 1] == '\n')
+            line[len - 1] = '\0';
+        ok = put_u32(out, lineno) && put_str(out, line) &&
+             put_u32(out, cl.argc ? qtb_name_index(&names, cl.argv[0]) : 0) &&
+             put_u32(out, cl.argc);
+        for (int i = 1; ok && i < cl.argc; i++)
+            ok = put_str(out, cl.argv[i]);
+        nlines++;
+        release_args(&cl);
+    }
+    free(line);
+    ok = ok && !ferror(in);
+
+    long names_offset = ftell(out);
+    for (uint32_t i = 0; i < names.count; i++)
+        ok = ok && put_str(out, names.names[i]);
+    qtb_free_names(&names);
+    qtb_free_names(&macros);
+
+    ok = ok && !fseek(out, 4, SEEK_SET) && put_u32(out, names.count) &&
+         put_u32(out, nlines) && put_u32(out, names_offset);
+    ok = !fclose(out) && ok;
+    fclose(in);
+    if (!ok)
+        report(1, "Could not write compiled file '%s'", out_name);
+    return ok;
+}
+
+/* Reader of a compiled file, checking that nothing lies past its end */
+typedef struct {
+    char *p, *end;
+    bool ok;
+} qtb_reader_t;
+
+static uint32_t get_u32(qtb_reader_t *r)
+{
+    uint32_t v = 0;
+    if (r->end - r->p < (ptrdiff_t) sizeof(v)) {
+        r->ok = false;
+        return 0;
+    }
+    memcpy(&v, r->p, sizeof(v));
+    r->p += sizeof(v);
+    return v;
+}
+
+static char *get_str(qtb_reader_t *r)
+{
+    uint32_t len = get_u32(r);
+    if (!r->ok || (size_t) (r->end - r->p) <= len || r->p[len]) {
+        r->ok = false;
+        return "";
+    }
+    char *s = r->p;
+    r->p += len + 1;
+    return s;
+}
+
+bool run_console_compiled(const char *file_name)
+{
+    int fd = open(file_name, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st)) {
+        report(1, "ERROR: Could not open compiled file '%s'", file_name);
+        if (fd >= 0)
+            close(fd);
+        return false;
+    }
+    /* Private and writable, as commands get their arguments as char * */
+    char *map = st.st_size ? mmap(NULL, st.st_size, PROT_READ | PROT_WRITE,
+                                  MAP_PRIVATE, fd, 0)
+                           : MAP_FAILED;
+    close(fd);
+    if (map == MAP_FAILED || st.st_size < 4 || memcmp(map, QTB_MAGIC, 4)) {
+        report(1, "ERROR: '%s' is not a compiled command file", file_name);
+        if (map != MAP_FAILED)
+            munmap(map, st.st_size);
+        return false;
+    }
+
+    qtb_reader_t r = {map + 4, map + st.st_size, true};
+    uint32_t nnames = get_u32(&r);
+    uint32_t nlines = get_u32(&r);
+    uint32_t names_offset = get_u32(&r);
+    char *source = get_str(&r);
+    char *lines = r.p;
+    if (names_offset < lines - map || names_offset > st.st_size)
+        r.ok = false;
+
+    /* Resolve every name to its command once */
+    cmd_element_t **cmds = NULL;
+    char **names = NULL;
+    if (r.ok && nnames) {
+        cmds = calloc_or_fail(nnames, sizeof(cmd_element_t *),
+                              "run_console_compiled");
+        names = calloc_or_fail(nnames, sizeof(char *), "run_console_compiled");
+        r.p = map + names_offset;
+        for (uint32_t i = 0; i < nnames; i++) {
+            names[i] = get_str(&r);
+            cmds[i] = table_find(&cmd_table, names[i]);
+        }
+    }
+    r.p = lines;
+    r.end = map + names_offset;
+
+    for (uint32_t n = 0; r.ok && n < nlines && !quit_flag; n++) {
+        int line = get_u32(&r);
+        const char *text = get_str(&r);
+        uint32_t index = get_u32(&r);
+        uint32_t argc = get_u32(&r);
+        if (r.ok && echo) {
+            report_noreturn(1, prompt);
+            report_noreturn(1, "%s\n", text);
+        }
+        if (!argc)
+            continue;
+        /* Every argument takes at least 5 bytes */
+        if (!r.ok || index >= nnames ||
+            argc - 1 > (size_t) (r.end - r.p) / 5) {
+            r.ok = false;
+            break;
+        }
+
+        cmdline_t cl;
+        reserve_args(argc + 1, &cl);
+        cl.argc = argc;
+        cl.argv[0] = names[index];
+        for (uint32_t i = 1; i < argc; i++)
+            cl.argv[i] = get_str(&r);
+        cl.argv[argc] = NULL;
+
+        if (r.ok) {
+            cur_file = source;
+            cur_line = line;
+            run_cmd(cmds[index], cl.argc, cl.argv);
+            cur_file = NULL;
+        }
+        release_args(&cl);
+
+        /* Files pushed by source run before the next line */
+        while (!cmd_done())
+            cmd_select(0, NULL, NULL, NULL, NULL);
+    }
+    if (!r.ok)
+        report(1, "ERROR: Compiled file '%s' is corrupted", file_name);
+
+    if (cmds) {
+        free_array(cmds, nnames, sizeof(cmd_element_t *));
+        free_array(names, nnames, sizeof(char *));
+    }
+    munmap(map, st.st_size);
+    return r.ok && err_cnt == 0;
+}
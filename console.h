@@ -24,6 +24,7 @@ typedef struct __cmd_element {
     cmd_func_t operation;
     char *summary;
     char *param;
+    struct __latency *latency; /* Allocated once the command first runs */
     struct __cmd_element *next;
 } cmd_element_t;
 
@@ -56,6 +57,15 @@ bool get_int(char *vname, int *loc);
 /* Add function to be executed as part of program exit */
 void add_quit_helper(cmd_func_t qf);
 
+/* Function invoked with the arguments of every command before it runs */
+typedef void (*cmd_hook_t)(int argc, char *argv[]);
+
+/* Add function to be executed before every command */
+void add_cmd_hook(cmd_hook_t hook);
+
+/* Add function to be executed after every command */
+void add_cmd_post_hook(cmd_hook_t hook);
+
 /* Turn echoing on/off */
 void set_echo(bool on);
 
@@ -68,6 +78,14 @@ bool finish_cmd();
  */
 bool run_console(char *infile_name);
 
+/* Compile the commands of text file @in_name into @out_name, resolving
+ * command names and splitting arguments ahead of time
+ */
+bool compile_cmd_file(const char *in_name, const char *out_name);
+
+/* Run command loop on a file made by compile_cmd_file() */
+bool run_console_compiled(const char *file_name);
+
 /* Callback function to complete command by linenoise */
 void completion(const char *buf, line_completions_t *lc);
 
@@ -0,0 +1,382 @@
+/* External merge sort for queues larger than the memory budget */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "ext_sort.h"
+#include "queue.h"
+#include "report.h"
+#include "sort_stats.h"
+
+/* Size of the stdio buffer attached to every run file */
+#define RUN_BUFSIZE (64 * 1024)
+#define MIN_RUN_BUFSIZE 4096
+
+/* Maximum number of run files open at the same time.  Once reached, the runs
+ * on disk are merged into a single one before spilling continues, so that
+ * neither file descriptors nor I/O buffers grow with the queue size.
+ */
+#define MAX_RUNS 64
+
+/* A sorted run, either spilled to a temporary file or kept in memory.
+ * Records in a run file are a 32-bit length followed by the string bytes.
+ */
+typedef struct {
+    FILE *file;            /* NULL for the run kept in memory */
+    char *buf;             /* I/O buffer of @file */
+    size_t bufsize;        /* Size of @buf */
+    bool reading;          /* @file was rewound to read its records back */
+    struct list_head list; /* Unmerged elements of the in-memory run */
+    element_t *elem;       /* Next element to merge, NULL once drained */
+} run_t;
+
+/* State of the sort in progress.  It lives here rather than on the stack of
+ * ext_sort(), so that ext_sort_abort() can still reach it after a time limit
+ * exception has unwound the sort.
+ */
+static run_t runs[MAX_RUNS + 2]; /* The last one for merging spilled runs */
+static struct list_head pending; /* Run cut from the queue, not spilled yet */
+static struct list_head *sort_head;
+
+static void init_run(run_t *run)
+{
+    run->file = NULL;
+    run->buf = NULL;
+    run->bufsize = 0;
+    run->reading = false;
+    INIT_LIST_HEAD(&run->list);
+    run->elem = NULL;
+}
+
+/* I/O buffers of all runs together take at most half of the memory limit */
+static size_t run_bufsize()
+{
+    size_t size = RUN_BUFSIZE;
+    if (mblimit > 0) {
+        size_t share = ((size_t) mblimit << 20) / 2 / (MAX_RUNS + 1);
+        if (share < size)
+            size = share;
+    }
+    return size < MIN_RUN_BUFSIZE ? MIN_RUN_BUFSIZE : size;
+}
+
+static bool open_run(run_t *run)
+{
+    init_run(run);
+    run->file = tmpfile();
+    if (!run->file)
+        return false;
+    run->bufsize = run_bufsize();
+    run->buf = malloc_or_fail(run->bufsize, "open_run");
+    setvbuf(run->file, run->buf, _IOFBF, run->bufsize);
+    return true;
+}
+
+/* Release whatever a run still holds, including its file */
+static void close_run(run_t *run)
+{
+    if (run->file) {
+        if (run->elem)
+            q_release_element(run->elem);
+        fclose(run->file);
+        free_block(run->buf, run->bufsize);
+    }
+
+    element_t *e, *safe;
+    list_for_each_entry_safe (e, safe, &run->list, list)
+        q_release_element(e);
+    init_run(run);
+}
+
+/* Close @run after a failed merge.
+ *
+ * Return: the number of elements it still held, including the records of its
+ * file not read yet
+ */
+static size_t drop_run(run_t *run)
+{
+    size_t cnt;
+    if (run->file) {
+        uint32_t len;
+        cnt = run->elem ? 1 : 0;
+        while (fread(&len, sizeof(len), 1, run->file) == 1 &&
+               !fseek(run->file, len, SEEK_CUR))
+            cnt++;
+    } else {
+        /* The element to merge next is still on the list */
+        cnt = q_size(&run->list);
+    }
+    close_run(run);
+    return cnt;
+}
+
+static bool write_record(FILE *file, const char *s)
+{
+    uint32_t len = strlen(s);
+    return fwrite(&len, sizeof(len), 1, file) == 1 &&
+           fwrite(s, 1, len, file) == len;
+}
+
+/* Make a run file written so far readable from its first record */
+static bool rewind_run(run_t *run)
+{
+    run->reading = !fflush(run->file) && !fseek(run->file, 0, SEEK_SET);
+    return run->reading;
+}
+
+/* Stream the sorted elements of @list to a new run file and release them.
+ * On failure @list is left untouched.
+ */
+static bool spill_run(run_t *run, struct list_head *list)
+{
+    if (!open_run(run))
+        return false;
+
+    element_t *e, *safe;
+    list_for_each_entry (e, list, list) {
+        if (!write_record(run->file, e->value)) {
+            close_run(run);
+            return false;
+        }
+    }
+    /* The elements are now on file, and must not be left on @list too */
+    exception_defer();
+    bool ok = rewind_run(run);
+    if (ok) {
+        list_for_each_entry_safe (e, safe, list, list)
+            q_release_element(e);
+        INIT_LIST_HEAD(list);
+    } else {
+        close_run(run);
+    }
+    exception_resume();
+    return ok;
+}
+
+/* Advance @run to its next element.  A record read from a run file is loaded
+ * into a newly allocated element.
+ *
+ * Return: false if the record could not be read or allocated
+ */
+static bool next_elem(run_t *run)
+{
+    run->elem = NULL;
+    if (!run->file) {
+        if (!list_empty(&run->list))
+            run->elem = list_first_entry(&run->list, element_t, list);
+        return true;
+    }
+
+    uint32_t len;
+    if (fread(&len, sizeof(len), 1, run->file) != 1)
+        return !ferror(run->file);
+
+    /* The record is left unread if it cannot be loaded, to be counted */
+    element_t *e = malloc(sizeof(element_t));
+    if (!e) {
+        fseek(run->file, -(long) sizeof(len), SEEK_CUR);
+        return false;
+    }
+    e->value = malloc(len + 1);
+    if (!e->value) {
+        free(e);
+        fseek(run->file, -(long) sizeof(len), SEEK_CUR);
+        return false;
+    }
+    if (fread(e->value, 1, len, run->file) != len) {
+        q_release_element(e);
+        return false;
+    }
+    e->value[len] = '\0';
+    run->elem = e;
+    return true;
+}
+
+static inline int run_cmp(const run_t *runs, int a, int b, bool descend)
+{
+    int res = SORT_STRCMP(runs[a].elem->value, runs[b].elem->value);
+    if (descend)
+        res = -res;
+    /* Earlier runs hold earlier elements -- important for sort stability */
+    return res ? res : a - b;
+}
+
+static void sift_down(int *heap, int n, int i, const run_t *runs, bool descend)
+{
+    for (;;) {
+        int min = i, l = 2 * i + 1, r = 2 * i + 2;
+        if (l < n && run_cmp(runs, heap[l], heap[min], descend) < 0)
+            min = l;
+        if (r < n && run_cmp(runs, heap[r], heap[min], descend) < 0)
+            min = r;
+        if (min == i)
+            return;
+        int tmp = heap[i];
+        heap[i] = heap[min];
+        heap[min] = tmp;
+        i = min;
+    }
+}
+
+/* k-way merge of the first @k runs through a binary heap keyed on the head of
+ * every run.  The output goes to the queue @head, or to the run file @dst if
+ * @head is NULL.  All @k runs are closed on return, and the elements they
+ * still held after a failure are added to @lost.
+ */
+static bool merge_runs(int k,
+                       bool descend,
+                       struct list_head *head,
+                       run_t *dst,
+                       size_t *lost)
+{
+    int heap[MAX_RUNS + 1];
+    int n = 0;
+    bool ok = true;
+
+    SORT_STAT_ADD(merge_calls, 1);
+    /* Every element is held by exactly one run or the output between the
+     * steps of the merge, which is where an exception may stop it
+     */
+    exception_defer();
+    for (int i = 0; ok && i < k; i++) {
+        ok = next_elem(&runs[i]);
+        if (runs[i].elem)
+            heap[n++] = i;
+    }
+    exception_resume();
+    for (int i = n / 2 - 1; i >= 0; i--)
+        sift_down(heap, n, i, runs, descend);
+
+    while (ok && n) {
+        run_t *run = &runs[heap[0]];
+        element_t *e = run->elem;
+
+        exception_defer();
+        if (!run->file)
+            list_del(&e->list);
+        if (head) {
+            list_add_tail(&e->list, head);
+            SORT_STAT_ADD(link_writes, 4);
+        } else {
+            ok = write_record(dst->file, e->value);
+            q_release_element(e);
+        }
+        ok = next_elem(run) && ok;
+        exception_resume();
+
+        if (!run->elem)
+            heap[0] = heap[--n];
+        sift_down(heap, n, 0, runs, descend);
+    }
+    if (ok && dst)
+        ok = rewind_run(dst);
+
+    for (int i = 0; i < k; i++) {
+        if (ok)
+            close_run(&runs[i]);
+        else
+            *lost += drop_run(&runs[i]);
+    }
+    return ok;
+}
+
+bool ext_sort(struct list_head *head,
+              bool descend,
+              size_t run_size,
+              run_sort_func_t sort,
+              size_t *lost)
+{
+    *lost = 0;
+    if (!head || list_empty(head) || list_is_singular(head))
+        return true;
+    if (!run_size)
+        run_size = 1;
+
+    for (int i = 0; i < MAX_RUNS + 2; i++)
+        init_run(&runs[i]);
+    INIT_LIST_HEAD(&pending);
+    sort_head = head;
+
+    run_t *merged = &runs[MAX_RUNS + 1];
+    int k = 0;
+    bool ok = true;
+
+    /* Spill sorted runs until the rest of the queue fits into a single one */
+    for (;;) {
+        struct list_head *cut = head;
+        for (size_t cnt = 0; cnt < run_size && cut->next != head; cnt++)
+            cut = cut->next;
+        if (cut->next == head)
+            break;
+
+        list_cut_position(&pending, head, cut);
+        sort(&pending, descend);
+        if (!spill_run(&runs[k], &pending)) {
+            /* Out of disk space: keep this run and the rest in memory */
+            list_splice_init(&pending, head);
+            break;
+        }
+
+        if (++k == MAX_RUNS) {
+            if (!open_run(merged))
+                break;
+            ok = merge_runs(k, descend, NULL, merged, lost);
+            if (!ok) {
+                /* Elements merged so far went nowhere but to the file */
+                if (rewind_run(merged))
+                    *lost += drop_run(merged);
+                else
+                    close_run(merged);
+                k = 0;
+                break;
+            }
+            exception_defer();
+            runs[0] = *merged;
+            INIT_LIST_HEAD(&runs[0].list);
+            init_run(merged);
+            exception_resume();
+            k = 1;
+        }
+    }
+
+    /* Whatever is left of the queue becomes the last run, kept in memory */
+    run_t *last = &runs[k++];
+    list_splice_init(head, &last->list);
+    sort(&last->list, descend);
+
+    ok = merge_runs(k, descend, head, NULL, lost) && ok;
+    sort_head = NULL;
+    return ok;
+}
+
+bool ext_sort_stopped(size_t *lost)
+{
+    if (!sort_head)
+        return false;
+
+    /* Elements in memory go back to the queue, in whatever order the
+     * interrupted sort left them
+     */
+    list_splice_init(&pending, sort_head);
+
+    *lost = 0;
+    for (int i = 0; i < MAX_RUNS + 2; i++) {
+        run_t *run = &runs[i];
+        if (!run->file) {
+            list_splice_tail_init(&run->list, sort_head);
+            close_run(run);
+            continue;
+        }
+        /* A run being spilled still has its elements on @pending, while the
+         * records merged into a file so far have no other copy
+         */
+        if (!run->reading && (run != &runs[MAX_RUNS + 1] || !rewind_run(run))) {
+            close_run(run);
+            continue;
+        }
+        *lost += drop_run(run);
+    }
+    sort_head = NULL;
+    return true;
+}
@@ -0,0 +1,51 @@
+#ifndef LAB0_EXT_SORT_H
+#define LAB0_EXT_SORT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "list.h"
+
+/* In-memory sort applied to every run, e.g. q_sort() */
+typedef void (*run_sort_func_t)(struct list_head *head, bool descend);
+
+/**
+ * ext_sort() - Stable external merge sort of a queue
+ * @head: header of queue
+ * @descend: whether or not to sort in descending order
+ * @run_size: maximum number of elements sorted in memory at once
+ * @sort: stable in-memory sort used for every run
+ * @lost: set to the number of elements that could not be read back
+ *
+ * The queue is consumed in runs of @run_size elements.  Every run is sorted
+ * in memory, streamed to a temporary file and its elements are released, so
+ * that only one run worth of elements is resident while spilling.  The runs
+ * are then k-way merged back into @head, allocating each element again as its
+ * record is read.  The elements of the queue are all resident when the sort
+ * starts, so only the buffers of the sort itself are bounded by 'mblimit'.
+ * Elements are released as they are spilled and allocated again as they are
+ * merged, so that the sort never holds more of them than the queue did.
+ *
+ * Return: true for success, false if a run could not be read back, as when an
+ * element cannot be allocated again.  In the latter case @head holds the
+ * elements merged so far in sorted order, and the others are released and
+ * counted in @lost.
+ */
+bool ext_sort(struct list_head *head,
+              bool descend,
+              size_t run_size,
+              run_sort_func_t sort,
+              size_t *lost);
+
+/**
+ * ext_sort_stopped() - Clean up after an exception stopped ext_sort()
+ * @lost: set to the number of elements lost with the run files
+ *
+ * Run files are closed and their buffers released.  Elements still in memory
+ * are put back into the queue, in no particular order.
+ *
+ * Return: true if the last call of ext_sort() did not finish
+ */
+bool ext_sort_stopped(size_t *lost);
+
+#endif /* LAB0_EXT_SORT_H */
@@ -1,13 +1,26 @@
 /* Test support code */
 
+#include <math.h>
+#include <pthread.h>
 #include <setjmp.h>
 #include <signal.h>
+#include <stdatomic.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/types.h>
 #include <unistd.h>
 
+#if defined(__APPLE__)
+#include <malloc/malloc.h>
+#define malloc_usable_size malloc_size
+#else
+#include <malloc.h>
+#endif
+
+#include "random.h"
 #include "report.h"
 
 /* Our program needs to use regular malloc/free */
@@ -28,36 +41,125 @@
 /* Byte to fill newly malloced space with */
 #define FILLCHAR 0x55
 
+/* Bytes filled at each end of a payload with POISON_EDGES */
+#define POISON_EDGE_BYTES 16
+
 /* Data structures used by our code */
 
-/* Represent allocated blocks as doubly-linked list, with
- * next and prev pointers at beginning
- */
+/* Header placed in front of every allocated block */
 typedef struct __block_element {
-    struct __block_element *next, *prev;
     size_t payload_size;
+    const void *site;    /* Return address of the allocating call */
     size_t magic_header; /* Marker to see if block seems legitimate */
-    unsigned char payload[0];
+    size_t mapping_bytes; /* Length of the mapping of a guarded block, else 0 */
+    unsigned char payload[0] __attribute__((aligned(16)));
     /* Also place magic number at tail of every block */
 } block_element_t;
 
-static block_element_t *allocated = NULL;
-static size_t allocated_count = 0;
+/* Allocated blocks are tracked in an open-addressing hash set keyed on their
+ * address, with linear probing and backward-shift deletion.  Freeing a block
+ * checks it is really allocated in constant time, however many blocks exist.
+ */
+#define MIN_SET_BITS 6
+
+/* Freed blocks of up to MAG_MAX_BYTES, header and footer included, are kept
+ * by the freeing thread for reuse, in magazines of MAG_ROUNDS blocks per size
+ * class of MAG_GRAIN bytes.  Most allocations then do not reach malloc.
+ */
+#define MAG_GRAIN 16
+#define MAG_MAX_BYTES 512
+#define MAG_CLASSES (MAG_MAX_BYTES / MAG_GRAIN)
+#define MAG_ROUNDS 64
+
+typedef struct {
+    int n;
+    void *blocks[MAG_ROUNDS];
+} magazine_t;
+
+/* Call sites profiled per thread.  Allocations from further sites are
+ * counted under a NULL site.
+ */
+#define SITE_SLOTS 256
+
+/* Every thread registers the blocks it allocates in a registry of its own,
+ * so that threads only contend when one frees a block allocated by another.
+ * Such a block is looked up in the registries of all threads.  The registry
+ * outlives its thread as long as it holds blocks.
+ */
+typedef struct __registry {
+    pthread_mutex_t lock; /* Guards all but the magazines */
+    block_element_t **set;
+    unsigned int bits; /* Set has 2^bits slots */
+    size_t count;      /* Number of blocks in the set */
 
-/* Percent probability of malloc failure */
+    /* Allocations are numbered from 1 since the fault injection schedule was
+     * last reset.  The number of the next one which may fail is precomputed,
+     * so that deciding not to fail costs a single comparison.
+     */
+    uint64_t alloc_index;
+    uint64_t next_failure;
+    uint64_t random_failure; /* Next failure by probability */
+    uint64_t fail_state;     /* PRNG state */
+
+    /* Profile of the blocks allocated by the thread */
+    uint64_t allocs, frees, bytes, live_bytes;
+    uint64_t size_hist[MEM_HIST_BUCKETS];
+    mem_site_t sites[SITE_SLOTS];
+    mem_site_t other_sites;
+
+    magazine_t mags[MAG_CLASSES]; /* Only used by the owning thread */
+    int id;                       /* Order of creation, 0 for the first */
+    struct __registry *next;
+} registry_t;
+
+static pthread_mutex_t registries_lock = PTHREAD_MUTEX_INITIALIZER;
+static registry_t *registries = NULL;
+static int registries_created = 0;
+static pthread_key_t registry_key;
+static pthread_once_t registry_key_once = PTHREAD_ONCE_INIT;
+static __thread registry_t *self = NULL;
+
+/* Fault injection schedule, see reset_fault_injection() */
 int fail_probability = 0;
+int fail_seed = 0;
+int fail_nth = 0;
+int fail_every = 0;
+int fail_above = 0;
+
+/* Allocations and bytes requested by the thread, see mem_thread_totals() */
+static __thread uint64_t thread_allocs = 0, thread_bytes = 0;
+
+/* Bytes live in all threads together, and their highest value so far */
+static atomic_size_t live_bytes = 0;
+static atomic_size_t peak_bytes = 0;
+static atomic_size_t window_peak = 0; /* Peak since mem_window_start() */
+
+int poison_mode = POISON_FULL;
+int poison_every = 16;
+static __thread unsigned int poison_tick = 0; /* For POISON_SAMPLED */
+
+int guard_above = 0;
 
-static bool cautious_mode = true;
 static bool noallocate_mode = false;
-static bool error_occurred = false;
-static char *error_message = "";
+static atomic_bool error_occurred = false;
 
-static int time_limit = 1;
+int time_limit = 1;
 
-/* Data for managing exceptions */
-static jmp_buf env;
-static volatile sig_atomic_t jmp_ready = false;
-static bool time_limited = false;
+/* Data for managing exceptions, separate for every thread */
+static __thread sigjmp_buf env;
+static __thread volatile sig_atomic_t jmp_ready = false;
+static __thread bool time_limited = false;
+static __thread char *error_message = "";
+
+/* The longjmp of an exception must not leave harness code while it holds a
+ * registry lock or is within malloc, or the next allocation of the thread
+ * would deadlock or find the heap half updated.  Such code runs as a critical
+ * section, and a time limit expiring within it only takes effect once the
+ * outermost section is left.  Counting costs far less than blocking SIGALRM
+ * with a system call on every allocation.
+ */
+static __thread volatile sig_atomic_t critical_depth = 0;
+static __thread char *volatile deferred_message = NULL;
 
 /* For test_malloc and test_calloc */
 typedef enum {
@@ -67,52 +169,500 @@ typedef enum {
 
 /* Internal functions */
 
+static inline void enter_critical()
+{
+    critical_depth++;
+    atomic_signal_fence(memory_order_seq_cst);
+}
+
+static inline void leave_critical()
+{
+    atomic_signal_fence(memory_order_seq_cst);
+    if (--critical_depth == 0 && deferred_message) {
+        char *msg = deferred_message;
+        deferred_message = NULL;
+        trigger_exception(msg);
+    }
+}
+
+/* splitmix64 */
+static inline uint64_t fail_rand(registry_t *r)
+{
+    r->fail_state += 0x9e3779b97f4a7c15ULL;
+    return random_shuffle(r->fail_state);
+}
+
+/* Draw the number of the next allocation failing by probability.  The gap
+ * between failures follows a geometric distribution, which is the same as
+ * failing every allocation independently.
+ */
+static void draw_random_failure(registry_t *r)
+{
+    if (fail_probability <= 0) {
+        r->random_failure = UINT64_MAX;
+        return;
+    }
+    if (fail_probability >= 100) {
+        r->random_failure = r->alloc_index + 1;
+        return;
+    }
+
+    double u = ((fail_rand(r) >> 11) + 1) * 0x1.0p-53; /* (0, 1] */
+    double gap = floor(log(u) / log1p(-0.01 * fail_probability));
+    r->random_failure = gap < (double) (UINT64_MAX - r->alloc_index - 1)
+                            ? r->alloc_index + 1 + (uint64_t) gap
+                            : UINT64_MAX;
+}
+
+/* Earliest allocation after the current one that any rule may fail */
+static void schedule_failure(registry_t *r)
+{
+    uint64_t next = r->random_failure;
+    if (fail_nth > 0 && (uint64_t) fail_nth > r->alloc_index &&
+        (uint64_t) fail_nth < next)
+        next = fail_nth;
+    if (fail_every > 0) {
+        uint64_t m = (r->alloc_index / fail_every + 1) * fail_every;
+        if (m < next)
+            next = m;
+    }
+    /* The size of every allocation has to be checked */
+    if (fail_above > 0)
+        next = r->alloc_index + 1;
+    r->next_failure = next;
+}
+
+/* Restart the schedule of @r.  Every thread draws random failures from its
+ * own stream, the first one from fail_seed itself.
+ */
+static void reset_schedule(registry_t *r)
+{
+    r->alloc_index = 0;
+    r->fail_state = (uint64_t) fail_seed + r->id;
+    draw_random_failure(r);
+    schedule_failure(r);
+}
+
+static bool fail_scheduled(registry_t *r, size_t size)
+{
+    uint64_t i = r->alloc_index;
+    bool fail = i == r->random_failure || i == (uint64_t) fail_nth ||
+                (fail_every > 0 && i % fail_every == 0) ||
+                (fail_above > 0 && size > (size_t) fail_above);
+
+    if (i >= r->random_failure)
+        draw_random_failure(r);
+    schedule_failure(r);
+    return fail;
+}
+
 /* Should this allocation fail? */
-static bool fail_allocation()
+static inline bool fail_allocation(registry_t *r, size_t size)
 {
-    double weight = (double) random() / RAND_MAX;
-    return (weight < 0.01 * fail_probability);
+    if (++r->alloc_index < r->next_failure)
+        return false;
+    return fail_scheduled(r, size);
 }
 
-/* Find header of block, given its payload.
- * Signal error if doesn't seem like legitimate block
+/* Give cached blocks back to malloc, and drop the registry of an exiting
+ * thread unless blocks it allocated are still alive.
  */
-static block_element_t *find_header(void *p)
+static void registry_destroy(void *arg)
 {
-    if (!p) {
-        report_event(MSG_ERROR, "Attempting to free null block");
-        error_occurred = true;
+    registry_t *r = arg;
+    for (int c = 0; c < MAG_CLASSES; c++) {
+        while (r->mags[c].n)
+            free(r->mags[c].blocks[--r->mags[c].n]);
     }
 
-    block_element_t *b =
-        (block_element_t *) ((size_t) p - sizeof(block_element_t));
-    if (cautious_mode) {
-        /* Make sure this is really an allocated block */
-        block_element_t *ab = allocated;
-        bool found = false;
-        while (ab && !found) {
-            found = ab == b;
-            ab = ab->next;
+    pthread_mutex_lock(&registries_lock);
+    pthread_mutex_lock(&r->lock);
+    bool empty = !r->count;
+    pthread_mutex_unlock(&r->lock);
+    if (empty) {
+        registry_t **pp = &registries;
+        while (*pp != r)
+            pp = &(*pp)->next;
+        *pp = r->next;
+        pthread_mutex_destroy(&r->lock);
+        free(r->set);
+        free(r);
+    }
+    pthread_mutex_unlock(&registries_lock);
+}
+
+static void registry_key_create()
+{
+    pthread_key_create(&registry_key, registry_destroy);
+}
+
+/* Registry of the calling thread, created on its first use */
+static registry_t *my_registry()
+{
+    if (self)
+        return self;
+
+    registry_t *r = calloc(1, sizeof(registry_t));
+    if (!r) {
+        report_event(MSG_FATAL, "Couldn't allocate any more memory");
+        return NULL;
+    }
+    pthread_mutex_init(&r->lock, NULL);
+    pthread_once(&registry_key_once, registry_key_create);
+    pthread_setspecific(registry_key, r);
+
+    pthread_mutex_lock(&registries_lock);
+    r->id = registries_created++;
+    reset_schedule(r);
+    r->next = registries;
+    registries = r;
+    pthread_mutex_unlock(&registries_lock);
+
+    self = r;
+    return r;
+}
+
+/* Home slot of a block.  Blocks within the same 256 bytes land in the same
+ * group of 16 slots, and neighbouring groups hold neighbouring addresses, so
+ * that runs of blocks allocated or freed in address order walk the set
+ * sequentially instead of missing the cache on every block.  Address bits
+ * above the span of the set are folded in to spread heaps larger than it.
+ */
+static inline size_t block_slot(const registry_t *r, const block_element_t *b)
+{
+    uintptr_t a = (uintptr_t) b;
+    size_t group = (a >> 8) ^ (a >> (r->bits + 4));
+    return (group << 4 | ((a >> 4) & 15)) & (((size_t) 1 << r->bits) - 1);
+}
+
+static void set_insert(registry_t *r, block_element_t *b)
+{
+    size_t mask = ((size_t) 1 << r->bits) - 1;
+    size_t i = block_slot(r, b);
+    while (r->set[i])
+        i = (i + 1) & mask;
+    r->set[i] = b;
+}
+
+/* Rehash all blocks into a set of 2^bits slots */
+static bool set_resize(registry_t *r, unsigned int bits)
+{
+    block_element_t **old = r->set;
+    size_t old_size = old ? (size_t) 1 << r->bits : 0;
+
+    r->set = calloc((size_t) 1 << bits, sizeof(block_element_t *));
+    if (!r->set) {
+        r->set = old;
+        return false;
+    }
+    r->bits = bits;
+    for (size_t i = 0; i < old_size; i++) {
+        if (old[i])
+            set_insert(r, old[i]);
+    }
+    free(old);
+    return true;
+}
+
+/* Register a new block, keeping the set at most half full */
+static bool set_add(registry_t *r, block_element_t *b)
+{
+    if (!r->set) {
+        if (!set_resize(r, MIN_SET_BITS))
+            return false;
+    } else if ((r->count + 1) * 2 > (size_t) 1 << r->bits) {
+        if (!set_resize(r, r->bits + 1))
+            return false;
+    }
+    set_insert(r, b);
+    r->count++;
+    return true;
+}
+
+/* Grow the set at once to hold @more blocks than now, at most half full */
+static bool set_reserve(registry_t *r, size_t more)
+{
+    unsigned int bits = r->set ? r->bits : MIN_SET_BITS;
+    while ((r->count + more) * 2 > (size_t) 1 << bits)
+        bits++;
+    return (r->set && bits == r->bits) || set_resize(r, bits);
+}
+
+/* Slot holding block @b, or -1 if it is not allocated */
+static ssize_t set_find(const registry_t *r, const block_element_t *b)
+{
+    if (!r->set)
+        return -1;
+
+    size_t mask = ((size_t) 1 << r->bits) - 1;
+    for (size_t i = block_slot(r, b); r->set[i]; i = (i + 1) & mask) {
+        if (r->set[i] == b)
+            return i;
+    }
+    return -1;
+}
+
+/* Empty slot @i, shifting back later blocks of its probe sequence so that no
+ * lookup stops early at the hole.
+ */
+static void set_remove(registry_t *r, size_t i)
+{
+    size_t mask = ((size_t) 1 << r->bits) - 1;
+    for (size_t j = (i + 1) & mask; r->set[j]; j = (j + 1) & mask) {
+        /* The block at j may move to i unless its home lies in (i, j] */
+        size_t home = block_slot(r, r->set[j]);
+        if (((j - home) & mask) >= ((j - i) & mask)) {
+            r->set[i] = r->set[j];
+            i = j;
         }
-        if (!found) {
-            report_event(MSG_ERROR,
-                         "Attempted to free unallocated block.  Address = %p",
-                         p);
-            error_occurred = true;
+    }
+    r->set[i] = NULL;
+
+    /* Rehashing while a large queue is being freed would cost more than the
+     * frees themselves, so the set is only released once empty.
+     */
+    if (!--r->count) {
+        free(r->set);
+        r->set = NULL;
+    }
+}
+
+/* Find the registry holding block @b, searching the one of the calling
+ * thread first.  It is returned locked, with @slot set to the slot of @b.
+ */
+static registry_t *find_owner(registry_t *mine,
+                              const block_element_t *b,
+                              size_t *slot)
+{
+    ssize_t i;
+
+    pthread_mutex_lock(&mine->lock);
+    if ((i = set_find(mine, b)) >= 0) {
+        *slot = i;
+        return mine;
+    }
+    pthread_mutex_unlock(&mine->lock);
+
+    /* Freed by another thread than the allocating one */
+    pthread_mutex_lock(&registries_lock);
+    for (registry_t *r = registries; r; r = r->next) {
+        if (r == mine)
+            continue;
+        pthread_mutex_lock(&r->lock);
+        if ((i = set_find(r, b)) >= 0) {
+            pthread_mutex_unlock(&registries_lock);
+            *slot = i;
+            return r;
         }
+        pthread_mutex_unlock(&r->lock);
     }
+    pthread_mutex_unlock(&registries_lock);
+    return NULL;
+}
 
-    if (b->magic_header != MAGICHEADER) {
-        report_event(
-            MSG_ERROR,
-            "Attempted to free unallocated or corrupted block.  Address = %p",
-            p);
-        error_occurred = true;
+/* Profile entry of call site @site in @r */
+static mem_site_t *find_site(registry_t *r, const void *site, bool create)
+{
+    size_t i = ((uint64_t) (uintptr_t) site * 0x9e3779b97f4a7c15ULL) >> 56;
+    for (size_t n = 0; n < SITE_SLOTS; n++) {
+        mem_site_t *e = &r->sites[(i + n) % SITE_SLOTS];
+        if (e->site == site)
+            return e;
+        if (!e->site) {
+            if (!create)
+                break;
+            e->site = site;
+            return e;
+        }
+    }
+    return &r->other_sites;
+}
+
+/* Histogram bucket of @size: 0 for 0 bytes, then one per power of 2 */
+static inline int size_bucket(size_t size)
+{
+    return size ? 64 - __builtin_clzll(size) : 0;
+}
+
+static void raise_to(atomic_size_t *peak_p, size_t now)
+{
+    size_t peak = atomic_load(peak_p);
+    while (now > peak && !atomic_compare_exchange_weak(peak_p, &peak, now))
+        ;
+}
+
+static void update_peak(size_t now)
+{
+    raise_to(&peak_bytes, now);
+    raise_to(&window_peak, now);
+}
+
+static void profile_alloc(registry_t *r, const void *site, size_t size)
+{
+    r->allocs++;
+    r->bytes += size;
+    r->live_bytes += size;
+    thread_allocs++;
+    thread_bytes += size;
+    r->size_hist[size_bucket(size)]++;
+
+    mem_site_t *e = find_site(r, site, true);
+    e->allocs++;
+    e->bytes += size;
+    e->live_blocks++;
+    e->live_bytes += size;
+
+    update_peak(atomic_fetch_add(&live_bytes, size) + size);
+}
+
+static void profile_free(registry_t *r, const void *site, size_t size)
+{
+    r->frees++;
+    r->live_bytes -= size;
+
+    mem_site_t *e = find_site(r, site, false);
+    e->live_blocks--;
+    e->live_bytes -= size;
+
+    atomic_fetch_sub(&live_bytes, size);
+}
+
+/* Account for a block of @site changing from @old_size to @size bytes.  The
+ * growth counts as bytes requested, but not as another allocation.
+ */
+static void profile_resize(registry_t *r,
+                           const void *site,
+                           size_t old_size,
+                           size_t size)
+{
+    mem_site_t *e = find_site(r, site, false);
+    if (size < old_size) {
+        r->live_bytes -= old_size - size;
+        e->live_bytes -= old_size - size;
+        atomic_fetch_sub(&live_bytes, old_size - size);
+        return;
+    }
+
+    size_t grown = size - old_size;
+    r->bytes += grown;
+    r->live_bytes += grown;
+    thread_bytes += grown;
+    e->bytes += grown;
+    e->live_bytes += grown;
+    update_peak(atomic_fetch_add(&live_bytes, grown) + grown);
+}
+
+/* Fill the payload @p of @size bytes with FILLCHAR as far as the policy
+ * asks for
+ */
+static void poison(unsigned char *p, size_t size)
+{
+    switch (poison_mode) {
+    case POISON_FULL:
+        memset(p, FILLCHAR, size);
+        break;
+    case POISON_EDGES:
+        if (size <= 2 * POISON_EDGE_BYTES) {
+            memset(p, FILLCHAR, size);
+        } else {
+            memset(p, FILLCHAR, POISON_EDGE_BYTES);
+            memset(p + size - POISON_EDGE_BYTES, FILLCHAR, POISON_EDGE_BYTES);
+        }
+        break;
+    case POISON_SAMPLED:
+        if (poison_every <= 1 || ++poison_tick % poison_every == 0)
+            memset(p, FILLCHAR, size);
+        break;
+    default:
+        break;
+    }
+}
+
+/* Size of the memory backing a block with @size bytes of payload */
+static inline size_t block_bytes(size_t size)
+{
+    return size + sizeof(block_element_t) + sizeof(size_t);
+}
+
+/* Magazine class of blocks of @bytes, or -1 if they are not cached */
+static inline int mag_class(size_t bytes)
+{
+    return bytes <= MAG_MAX_BYTES ? (int) ((bytes - 1) / MAG_GRAIN) : -1;
+}
+
+/* Should a block with @size bytes of payload go against a guard page? */
+static inline bool guarded(size_t size)
+{
+    return guard_above > 0 && size > (size_t) guard_above;
+}
+
+/* Map a block with @size bytes of payload to end right before an
+ * inaccessible page, so that overrunning it faults at once.  Only the
+ * footer and less than 16 bytes of alignment padding lie in between, and
+ * the padding is checked like the footer.
+ */
+static block_element_t *map_guarded(size_t size)
+{
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t bytes = (block_bytes(size) + 15) & ~(size_t) 15;
+    size_t len = (bytes + page - 1) / page * page + page;
+    unsigned char *m = mmap(NULL, len, PROT_READ | PROT_WRITE,
+                            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (m == MAP_FAILED)
+        return NULL;
+    if (mprotect(m + len - page, page, PROT_NONE)) {
+        munmap(m, len);
+        return NULL;
     }
 
+    /* The block starts within the first page of the mapping */
+    block_element_t *b = (block_element_t *) (m + len - page - bytes);
+    b->mapping_bytes = len;
     return b;
 }
 
+static void unmap_guarded(block_element_t *b)
+{
+    size_t page = sysconf(_SC_PAGESIZE);
+    munmap((void *) ((uintptr_t) b & ~(page - 1)), b->mapping_bytes);
+}
+
+static void *get_block(registry_t *r, size_t size)
+{
+    if (guarded(size))
+        return map_guarded(size);
+
+    size_t bytes = block_bytes(size);
+    int c = mag_class(bytes);
+    block_element_t *b;
+    if (c < 0)
+        b = malloc(bytes);
+    else if (r->mags[c].n)
+        b = r->mags[c].blocks[--r->mags[c].n];
+    else /* Round up, so that any block of the class can serve any size */
+        b = malloc((c + 1) * MAG_GRAIN);
+    if (b)
+        b->mapping_bytes = 0;
+    return b;
+}
+
+/* Blocks are cached by the memory actually behind them, which realloc may
+ * have made larger than the class of their payload size
+ */
+static void put_block(registry_t *r, block_element_t *b)
+{
+    if (b && b->mapping_bytes) {
+        unmap_guarded(b);
+        return;
+    }
+
+    int c = (int) (malloc_usable_size(b) / MAG_GRAIN) - 1;
+    if (c >= 0 && c < MAG_CLASSES && r->mags[c].n < MAG_ROUNDS)
+        r->mags[c].blocks[r->mags[c].n++] = b;
+    else
+        free(b);
+}
+
 /* Given pointer to block, find its footer */
 static size_t *find_footer(block_element_t *b)
 {
@@ -122,7 +672,44 @@ static size_t *find_footer(block_element_t *b)
     return p;
 }
 
-static void *alloc(alloc_t alloc_type, size_t size)
+/* Alignment padding between the footer of a guarded block and its guard
+ * page, where an overrun passing the footer has not faulted yet
+ */
+static size_t guard_padding(block_element_t *b, unsigned char **pad)
+{
+    size_t page = sysconf(_SC_PAGESIZE);
+    unsigned char *guard = (unsigned char *) ((uintptr_t) b & ~(page - 1)) +
+                           b->mapping_bytes - page;
+    *pad = (unsigned char *) (find_footer(b) + 1);
+    return guard - *pad;
+}
+
+static void set_footer(block_element_t *b)
+{
+    *find_footer(b) = MAGICFOOTER;
+    if (b->mapping_bytes) {
+        unsigned char *pad;
+        memset(pad, FILLCHAR, guard_padding(b, &pad));
+    }
+}
+
+/* Is the footer of @b intact, and the guard padding if any? */
+static bool footer_intact(block_element_t *b)
+{
+    if (*find_footer(b) != MAGICFOOTER)
+        return false;
+    if (b->mapping_bytes) {
+        unsigned char *pad;
+        size_t n = guard_padding(b, &pad);
+        for (size_t i = 0; i < n; i++) {
+            if (pad[i] != FILLCHAR)
+                return false;
+        }
+    }
+    return true;
+}
+
+static void *do_alloc(alloc_t alloc_type, size_t size, const void *site)
 {
     if (noallocate_mode) {
         char *msg_alloc_forbidden[] = {
@@ -133,7 +720,18 @@ static void *alloc(alloc_t alloc_type, size_t size)
         return NULL;
     }
 
-    if (fail_allocation()) {
+    registry_t *r = my_registry();
+    block_element_t *new_block = get_block(r, size);
+    if (!new_block) {
+        report_event(MSG_FATAL, "Couldn't allocate any more memory");
+        error_occurred = true;
+    }
+
+    pthread_mutex_lock(&r->lock);
+    if (fail_allocation(r, size)) {
+        pthread_mutex_unlock(&r->lock);
+        put_block(r, new_block);
+
         char *msg_alloc_failure[] = {
             "Malloc returning NULL",
             "Calloc returning NULL",
@@ -142,38 +740,61 @@ static void *alloc(alloc_t alloc_type, size_t size)
         return NULL;
     }
 
-    block_element_t *new_block =
-        malloc(size + sizeof(block_element_t) + sizeof(size_t));
-    if (!new_block) {
-        report_event(MSG_FATAL, "Couldn't allocate any more memory");
-        error_occurred = true;
-    }
-
     // cppcheck-suppress nullPointerRedundantCheck
     new_block->magic_header = MAGICHEADER;
     // cppcheck-suppress nullPointerRedundantCheck
     new_block->payload_size = size;
-    *find_footer(new_block) = MAGICFOOTER;
-    void *p = (void *) &new_block->payload;
-    memset(p, !alloc_type * FILLCHAR, size);
-    // cppcheck-suppress nullPointerRedundantCheck
-    new_block->next = allocated;
-    // cppcheck-suppress nullPointerRedundantCheck
-    new_block->prev = NULL;
+    new_block->site = site;
+    set_footer(new_block);
+    bool added = set_add(r, new_block);
+    if (added)
+        profile_alloc(r, site, size);
+    pthread_mutex_unlock(&r->lock);
+    if (!added) {
+        report_event(MSG_FATAL, "Couldn't allocate any more memory");
+        error_occurred = true;
+    }
 
-    if (allocated)
-        allocated->prev = new_block;
-    allocated = new_block;
-    allocated_count++;
+    void *p = (void *) &new_block->payload;
+    if (alloc_type == TEST_CALLOC)
+        memset(p, 0, size);
+    else
+        poison(p, size);
+    return p;
+}
 
+static void *alloc(alloc_t alloc_type, size_t size, const void *site)
+{
+    enter_critical();
+    void *p = do_alloc(alloc_type, size, site);
+    leave_critical();
     return p;
 }
 
+/* Report a block whose header or footer was overwritten */
+static void check_block(block_element_t *b, const char *op)
+{
+    if (b->magic_header != MAGICHEADER) {
+        report_event(
+            MSG_ERROR,
+            "Attempted to %s unallocated or corrupted block.  Address = %p",
+            op, (void *) b->payload);
+        error_occurred = true;
+    }
+    if (!footer_intact(b)) {
+        report_event(MSG_ERROR,
+                     "Corruption detected in block with address %p when "
+                     "attempting to %s it",
+                     (void *) b->payload, op);
+        error_occurred = true;
+    }
+}
+
 /* Implementation of application functions */
 
 void *test_malloc(size_t size)
 {
-    return alloc(TEST_MALLOC, size);
+    return alloc(TEST_MALLOC, size, __builtin_return_address(0));
 }
 
 // cppcheck-suppress unusedFunction
@@ -184,10 +805,10 @@ void *test_calloc(size_t nelem, size_t elsize)
      */
     if (!nelem || !elsize || nelem > SIZE_MAX / elsize)
         return NULL;
-    return alloc(TEST_CALLOC, nelem * elsize);
+    return alloc(TEST_CALLOC, nelem * elsize, __builtin_return_address(0));
 }
 
-void test_free(void *p)
+static void do_free(void *p)
 {
     if (noallocate_mode) {
         report_event(MSG_FATAL, "Calls to free disallowed");
@@ -197,57 +818,288 @@ void test_free(void *p)
     if (!p)
         return;
 
-    block_element_t *b = find_header(p);
-    size_t footer = *find_footer(b);
-    if (footer != MAGICFOOTER) {
+    registry_t *mine = my_registry();
+    block_element_t *b =
+        (block_element_t *) ((size_t) p - sizeof(block_element_t));
+    size_t slot;
+    registry_t *owner = find_owner(mine, b, &slot);
+    if (!owner) {
         report_event(MSG_ERROR,
-                     "Corruption detected in block with address %p when "
-                     "attempting to free it",
-                     p);
+                     "Attempted to free unallocated block.  Address = %p", p);
         error_occurred = true;
+        return;
     }
+
+    check_block(b, "free");
     b->magic_header = MAGICFREE;
     *find_footer(b) = MAGICFREE;
-    memset(p, FILLCHAR, b->payload_size);
+    profile_free(owner, b->site, b->payload_size);
+    set_remove(owner, slot);
+    pthread_mutex_unlock(&owner->lock);
 
-    /* Unlink from list */
-    block_element_t *bn = b->next;
-    block_element_t *bp = b->prev;
-    if (bp)
-        bp->next = bn;
-    else
-        allocated = bn;
-    if (bn)
-        bn->prev = bp;
+    /* Accesses to a guarded block fault once it is unmapped */
+    if (!b->mapping_bytes)
+        poison(p, b->payload_size);
+    put_block(mine, b);
+}
+
+void test_free(void *p)
+{
+    enter_critical();
+    do_free(p);
+    leave_critical();
+}
+
+/* Resize in place whenever the memory behind the block has room for the new
+ * size, which is often the case for small blocks rounded up to their class.
+ * Otherwise the block is moved by realloc, and the registry follows it.
+ * Blocks going to or from a guarded mapping are always copied.
+ */
+static void *do_realloc(void *p, size_t size)
+{
+    if (noallocate_mode) {
+        report_event(MSG_FATAL, "Calls to realloc are disallowed");
+        return NULL;
+    }
+
+    if (!size) {
+        do_free(p);
+        return NULL;
+    }
+
+    registry_t *mine = my_registry();
+    pthread_mutex_lock(&mine->lock);
+    bool fail = fail_allocation(mine, size);
+    pthread_mutex_unlock(&mine->lock);
+    if (fail) {
+        /* Like realloc, leave the original block untouched */
+        report_event(MSG_WARN, "Realloc returning NULL");
+        return NULL;
+    }
+
+    block_element_t *b =
+        (block_element_t *) ((size_t) p - sizeof(block_element_t));
+    size_t slot;
+    registry_t *owner = find_owner(mine, b, &slot);
+    if (!owner) {
+        report_event(MSG_ERROR,
+                     "Attempted to realloc unallocated block.  Address = %p",
+                     p);
+        error_occurred = true;
+        return NULL;
+    }
+    check_block(b, "realloc");
 
-    free(b);
-    allocated_count--;
+    size_t old_size = b->payload_size;
+    block_element_t *moved = b, *copied = NULL;
+    if (b->mapping_bytes || guarded(size)) {
+        moved = get_block(mine, size);
+        if (moved) {
+            size_t mapping_bytes = moved->mapping_bytes;
+            memcpy(moved, b,
+                   sizeof(block_element_t) +
+                       (size < old_size ? size : old_size));
+            moved->mapping_bytes = mapping_bytes;
+            copied = b;
+        }
+    } else if (block_bytes(size) > malloc_usable_size(b)) {
+        moved = realloc(b, block_bytes(size));
+    }
+
+    if (moved != b) {
+        bool added = false;
+        if (moved) {
+            set_remove(owner, slot);
+            added = set_add(owner, moved);
+        }
+        if (!added) {
+            pthread_mutex_unlock(&owner->lock);
+            report_event(MSG_FATAL, "Couldn't allocate any more memory");
+            error_occurred = true;
+            return NULL;
+        }
+        b = moved;
+    }
+    b->payload_size = size;
+    set_footer(b);
+    profile_resize(owner, b->site, old_size, size);
+    pthread_mutex_unlock(&owner->lock);
+
+    if (copied) {
+        copied->magic_header = MAGICFREE;
+        put_block(mine, copied);
+    }
+    if (size > old_size)
+        poison(b->payload + old_size, size - old_size);
+    return b->payload;
+}
+
+// cppcheck-suppress unusedFunction
+void *test_realloc(void *p, size_t size)
+{
+    if (!p)
+        return alloc(TEST_MALLOC, size, __builtin_return_address(0));
+
+    enter_critical();
+    void *q = do_realloc(p, size);
+    leave_critical();
+    return q;
 }
 
 // cppcheck-suppress unusedFunction
 char *test_strdup(const char *s)
 {
     size_t len = strlen(s) + 1;
-    void *new = test_malloc(len);
+    void *new = alloc(TEST_MALLOC, len, __builtin_return_address(0));
     if (!new)
         return NULL;
 
     return memcpy(new, s, len);
 }
 
+/* Blocks still allocated by all threads together */
 size_t allocation_check()
 {
-    return allocated_count;
+    size_t count = 0;
+    enter_critical();
+    pthread_mutex_lock(&registries_lock);
+    for (registry_t *r = registries; r; r = r->next) {
+        pthread_mutex_lock(&r->lock);
+        count += r->count;
+        pthread_mutex_unlock(&r->lock);
+    }
+    pthread_mutex_unlock(&registries_lock);
+    leave_critical();
+    return count;
+}
+
+static int site_cmp(const void *a, const void *b)
+{
+    const mem_site_t *sa = a, *sb = b;
+    return (sa->site > sb->site) - (sa->site < sb->site);
+}
+
+static int site_bytes_cmp(const void *a, const void *b)
+{
+    const mem_site_t *sa = a, *sb = b;
+    return (sa->bytes < sb->bytes) - (sa->bytes > sb->bytes);
+}
+
+void mem_stats(mem_stats_t *stats)
+{
+    memset(stats, 0, sizeof(*stats));
+    enter_critical();
+    pthread_mutex_lock(&registries_lock);
+    for (registry_t *r = registries; r; r = r->next) {
+        pthread_mutex_lock(&r->lock);
+        stats->allocs += r->allocs;
+        stats->frees += r->frees;
+        stats->bytes += r->bytes;
+        stats->live_blocks += r->count;
+        stats->live_bytes += r->live_bytes;
+        for (int i = 0; i < MEM_HIST_BUCKETS; i++)
+            stats->size_hist[i] += r->size_hist[i];
+        pthread_mutex_unlock(&r->lock);
+    }
+    pthread_mutex_unlock(&registries_lock);
+    leave_critical();
+    stats->peak_bytes = atomic_load(&peak_bytes);
+}
+
+size_t mem_window_start()
+{
+    size_t now = atomic_load(&live_bytes);
+    atomic_store(&window_peak, now);
+    return now;
+}
+
+size_t mem_window_peak()
+{
+    return atomic_load(&window_peak);
+}
+
+void alloc_reserve(size_t blocks)
+{
+    registry_t *r = my_registry();
+    enter_critical();
+    pthread_mutex_lock(&r->lock);
+    set_reserve(r, blocks);
+    pthread_mutex_unlock(&r->lock);
+    leave_critical();
+}
+
+void mem_thread_totals(uint64_t *allocs, uint64_t *bytes)
+{
+    *allocs = thread_allocs;
+    *bytes = thread_bytes;
+}
+
+size_t mem_sites(mem_site_t *sites, size_t max)
+{
+    enter_critical();
+    pthread_mutex_lock(&registries_lock);
+    size_t n = 0, cap = 0;
+    for (registry_t *r = registries; r; r = r->next)
+        cap += SITE_SLOTS + 1;
+    mem_site_t *all = malloc(cap * sizeof(mem_site_t));
+    if (!all) {
+        pthread_mutex_unlock(&registries_lock);
+        leave_critical();
+        return 0;
+    }
+    for (registry_t *r = registries; r; r = r->next) {
+        pthread_mutex_lock(&r->lock);
+        for (int i = 0; i < SITE_SLOTS; i++) {
+            if (r->sites[i].site)
+                all[n++] = r->sites[i];
+        }
+        if (r->other_sites.allocs)
+            all[n++] = r->other_sites;
+        pthread_mutex_unlock(&r->lock);
+    }
+    pthread_mutex_unlock(&registries_lock);
+
+    /* Add up the threads allocating from the same site */
+    qsort(all, n, sizeof(mem_site_t), site_cmp);
+    size_t m = 0;
+    for (size_t i = 0; i < n; i++) {
+        if (m && all[m - 1].site == all[i].site) {
+            all[m - 1].allocs += all[i].allocs;
+            all[m - 1].bytes += all[i].bytes;
+            all[m - 1].live_blocks += all[i].live_blocks;
+            all[m - 1].live_bytes += all[i].live_bytes;
+        } else {
+            all[m++] = all[i];
+        }
+    }
+
+    qsort(all, m, sizeof(mem_site_t), site_bytes_cmp);
+    if (m > max)
+        m = max;
+    memcpy(sites, all, m * sizeof(mem_site_t));
+    free(all);
+    leave_critical();
+    return m;
 }
 
 /* Implementation of functions for testing */
 
-/* Set/unset cautious mode.
- * In this mode, makes extra sure any block to be freed is currently allocated.
- */
-void set_cautious_mode(bool cautious)
+void reset_fault_injection()
 {
-    cautious_mode = cautious;
+    if (!fail_seed && fail_probability > 0) {
+        while (!fail_seed)
+            fail_seed = random_u64() & INT32_MAX;
+    }
+
+    enter_critical();
+    pthread_mutex_lock(&registries_lock);
+    for (registry_t *r = registries; r; r = r->next) {
+        pthread_mutex_lock(&r->lock);
+        reset_schedule(r);
+        pthread_mutex_unlock(&r->lock);
+    }
+    pthread_mutex_unlock(&registries_lock);
+    leave_critical();
 }
 
 /* Set/unset restricted allocation mode.
@@ -261,9 +1113,7 @@ void set_noallocate_mode(bool noallocate)
 /* Return whether any errors have occurred since last time set error limit */
 bool error_check()
 {
-    bool e = error_occurred;
-    error_occurred = false;
-    return e;
+    return atomic_exchange(&error_occurred, false);
 }
 
 /* Prepare for a risky operation using setjmp.
@@ -272,8 +1122,10 @@ bool error_check()
 bool exception_setup(bool limit_time)
 {
     if (sigsetjmp(env, 1)) {
-        /* Got here from longjmp */
+        /* Got here from longjmp, never out of a critical section */
         jmp_ready = false;
+        critical_depth = 0;
+        deferred_message = NULL;
         if (time_limited) {
             alarm(0);
             time_limited = false;
@@ -306,9 +1158,24 @@ void exception_cancel()
     error_message = "";
 }
 
+void exception_defer()
+{
+    enter_critical();
+}
+
+void exception_resume()
+{
+    leave_critical();
+}
+
 /* Use longjmp to return to most recent exception setup */
 void trigger_exception(char *msg)
 {
+    if (critical_depth) {
+        deferred_message = msg;
+        return;
+    }
+
     error_occurred = true;
     error_message = msg;
     if (jmp_ready)
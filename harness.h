@@ -4,31 +4,122 @@
 #include <setjmp.h>
 #include <stdarg.h>
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 
 /* This test harness enables us to do stringent testing of code.
  * It overloads the library versions of malloc and free with ones that
  * allow checking for common allocation errors.
+ *
+ * The checks also hold for code running in several threads: every thread
+ * tracks its blocks and keeps its exception context on its own, and a block
+ * may be freed by another thread than the one allocating it.
  */
 
 void *test_malloc(size_t size);
 void *test_calloc(size_t nmemb, size_t size);
 void test_free(void *p);
 char *test_strdup(const char *s);
-/* FIXME: provide test_realloc as well */
+void *test_realloc(void *p, size_t size);
+
+/* Hold back exceptions, such as the time limit, until the matching
+ * exception_resume(), so that code keeping state of its own across them can
+ * update it consistently.  Calls nest.
+ */
+void exception_defer();
+void exception_resume();
 
 #ifdef INTERNAL
 
-/* Report number of allocated blocks */
+/* Report number of blocks allocated by all threads */
 size_t allocation_check();
 
-/* Probability of malloc failing, expressed as percent */
-extern int fail_probability;
+/* Allocation profile of all threads together */
+#define MEM_HIST_BUCKETS 65
+typedef struct {
+    uint64_t allocs, frees;
+    uint64_t bytes; /* Requested by all allocations so far */
+    uint64_t live_blocks, live_bytes;
+    uint64_t peak_bytes; /* Highest live_bytes so far */
+    /* Allocations of [2^(i-1), 2^i) bytes in bucket i, of 0 bytes in 0 */
+    uint64_t size_hist[MEM_HIST_BUCKETS];
+} mem_stats_t;
+
+void mem_stats(mem_stats_t *stats);
+
+/* Start a window over which mem_window_peak() tracks the highest live bytes
+ * of all threads, as around a single operation.
+ *
+ * Return: the bytes live at the start of the window
+ */
+size_t mem_window_start();
+size_t mem_window_peak();
+
+/* Make room in the bookkeeping of the calling thread for @blocks more
+ * allocations, so that a bulk insertion does not rehash it again and again
+ * as it grows.  Failing to do so is harmless.
+ */
+void alloc_reserve(size_t blocks);
+
+/* Allocations and bytes requested by the calling thread so far.  Unlike
+ * mem_stats(), it takes no lock, and is cheap enough to call around every
+ * command.
+ */
+void mem_thread_totals(uint64_t *allocs, uint64_t *bytes);
+
+/* Allocations made from one call site of malloc, calloc or strdup */
+typedef struct {
+    const void *site; /* Return address of the call, NULL for the rest */
+    uint64_t allocs, bytes;
+    uint64_t live_blocks, live_bytes;
+} mem_site_t;
+
+/* Fill @sites with up to @max call sites, most bytes allocated first.
+ * Return: number of call sites filled in
+ */
+size_t mem_sites(mem_site_t *sites, size_t max);
+
+/* How much of a payload is filled with a marker byte when allocated by
+ * malloc and when freed, to expose reads of uninitialized or freed memory.
+ * Less filling saves memory bandwidth on large workloads.  The footer of
+ * every block is checked regardless.
+ */
+typedef enum {
+    POISON_OFF,     /* No filling */
+    POISON_FULL,    /* Whole payload */
+    POISON_EDGES,   /* First and last bytes of the payload */
+    POISON_SAMPLED, /* Whole payload of every poison_every-th block */
+} poison_t;
+
+extern int poison_mode; /* A poison_t */
+extern int poison_every;
+
+/* Blocks with more bytes than this end right before an inaccessible page, so
+ * that overrunning them faults at once instead of being noticed by the
+ * footer check on free (0 = never).  Each takes a mapping of its own.
+ */
+extern int guard_above;
+
+/* Fault injection: an allocation fails if any of these rules says so */
+extern int fail_probability; /* Probability in percent */
+extern int fail_nth;         /* Number of the allocation to fail (0 = none) */
+extern int fail_every;       /* Fail every this many allocations (0 = none) */
+extern int fail_above;       /* Fail when more bytes are asked (0 = none) */
+
+/* Seed of the PRNG drawing random failures.  Runs with the same seed and
+ * commands fail the same allocations.
+ */
+extern int fail_seed;
 
 /*
- * Set/unset cautious mode.
- * In this mode, makes extra sure any block to be freed is currently allocated.
+ * Apply changes of the fault injection settings.  Allocations are numbered
+ * again from 1 and the PRNG is restarted from fail_seed, which is picked at
+ * random if 0 while failures are probable.
  */
-void set_cautious_mode(bool cautious);
+void reset_fault_injection();
+
+/* Seconds a risky operation may run before it is aborted (0 = unlimited) */
+extern int time_limit;
 
 /*
  * Set/unset restricted allocation mode.
@@ -40,7 +131,9 @@ void set_noallocate_mode(bool noallocate);
 bool error_check();
 
 /* Prepare for a risky operation using setjmp.
- * Function returns true for initial return, false for error return
+ * Function returns true for initial return, false for error return.
+ * The context belongs to the calling thread.  The time limit is a process
+ * alarm, so other threads should block SIGALRM.
  */
 bool exception_setup(bool limit_time);
 
@@ -51,12 +144,42 @@ void exception_cancel();
  */
 void trigger_exception(char *msg);
 
-#else /* !INTERNAL */
+#elif defined(RELEASE)
+
+/* Release builds of the queue skip the checks and go straight to the
+ * allocator, the C library one unless RELEASE_MALLOC, RELEASE_CALLOC,
+ * RELEASE_FREE, RELEASE_STRDUP and RELEASE_REALLOC name another.
+ */
+#ifdef RELEASE_MALLOC
+#define malloc RELEASE_MALLOC
+#endif
+#ifdef RELEASE_CALLOC
+#define calloc RELEASE_CALLOC
+#endif
+#ifdef RELEASE_FREE
+#define free RELEASE_FREE
+#endif
+#ifdef RELEASE_STRDUP
+#undef strdup
+#define strdup RELEASE_STRDUP
+#endif
+#ifdef RELEASE_REALLOC
+#define realloc RELEASE_REALLOC
+#endif
+
+#define test_malloc malloc
+#define test_calloc calloc
+#define test_free free
+#define test_strdup strdup
+#define test_realloc realloc
+
+#else /* !INTERNAL && !RELEASE */
 
 /* Tested program use our versions of malloc and free */
 #define malloc test_malloc
 #define calloc test_calloc
 #define free test_free
+#define realloc test_realloc
 
 /* Use undef to avoid strdup redefined error */
 #undef strdup
@@ -7,6 +7,7 @@
 
 #include "list.h"
 #include "queue.h"
+#include "sort_stats.h"
 
 #define likely(x) __builtin_expect(!!(x), 1)
 #define unlikely(x) __builtin_expect(!!(x), 0)
@@ -14,6 +15,19 @@
 static inline int cmp(const struct list_head *a,
                       const struct list_head *b,
                       int descend)
+{
+    const element_t *ea = list_entry(a, element_t, list);
+    const element_t *eb = list_entry(b, element_t, list);
+    int cmp_res = SORT_STRCMP(ea->value, eb->value);
+    return descend ? -cmp_res : cmp_res;
+}
+
+/* cmp() for calls which are callbacks rather than comparisons, and are left
+ * out of the sort statistics
+ */
+static inline int cmp_uncounted(const struct list_head *a,
+                                const struct list_head *b,
+                                int descend)
 {
     const element_t *ea = list_entry(a, element_t, list);
     const element_t *eb = list_entry(b, element_t, list);
@@ -32,7 +46,9 @@ merge(struct list_head *a, struct list_head *b, int descend)
     // cppcheck-suppress unassignedVariable
     struct list_head *head, **tail = &head;
 
+    SORT_STAT_ADD(merge_calls, 1);
     for (;;) {
+        SORT_STAT_ADD(link_writes, 1);
         /* if equal, take 'a' -- important for sort stability */
         if (cmp(a, b, descend) <= 0) {
             *tail = a;
@@ -52,6 +68,7 @@ merge(struct list_head *a, struct list_head *b, int descend)
             }
         }
     }
+    SORT_STAT_ADD(link_writes, 1);
     return head;
 }
 
@@ -71,7 +88,9 @@ __attribute__((nonnull(1, 2, 3))) static void merge_final(
     struct list_head *tail = head;
     uint8_t count = 0;
 
+    SORT_STAT_ADD(merge_calls, 1);
     for (;;) {
+        SORT_STAT_ADD(link_writes, 2);
         /* if equal, take 'a' -- important for sort stability */
         if (cmp(a, b, descend) <= 0) {
             tail->next = a;
@@ -94,6 +113,7 @@ __attribute__((nonnull(1, 2, 3))) static void merge_final(
 
     /* Finish linking remainder of list b on to tail */
     tail->next = b;
+    SORT_STAT_ADD(link_writes, 1);
     do {
         /*
          * If the merge is highly unbalanced (e.g. the input is
@@ -103,15 +123,18 @@ __attribute__((nonnull(1, 2, 3))) static void merge_final(
          * routine can invoke cond_resched() periodically.
          */
         if (unlikely(!++count))
-            cmp(b, b, descend);
+            cmp_uncounted(b, b, descend);
+        /* Only prev is written: the next links of the remainder stay */
         b->prev = tail;
         tail = b;
         b = b->next;
+        SORT_STAT_ADD(link_writes, 1);
     } while (b);
 
     /* And the final links to make a circular doubly-linked list */
     tail->next = head;
     head->prev = tail;
+    SORT_STAT_ADD(link_writes, 2);
 }
 
 /**
@@ -247,6 +270,7 @@ __attribute__((nonnull(1))) void list_sort(struct list_head *head, int descend)
             /* Install the merged result in place of the inputs */
             a->prev = b->prev;
             *tail = a;
+            SORT_STAT_ADD(link_writes, 2);
         }
 
         /* Move one element from input list to pending */
@@ -254,6 +278,7 @@ __attribute__((nonnull(1))) void list_sort(struct list_head *head, int descend)
         pending = list;
         list = list->next;
         pending->next = NULL;
+        SORT_STAT_ADD(link_writes, 2);
         count++;
     } while (list);
 
@@ -0,0 +1,104 @@
+/* Hardware performance counters through perf_event_open(2) */
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "perf.h"
+
+static int fds[PERF_NR] = {-1, -1, -1, -1, -1, -1};
+
+#if defined(__linux__)
+
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+
+#define CACHE_READ_MISS(cache)                      \
+    ((cache) | (PERF_COUNT_HW_CACHE_OP_READ << 8) | \
+     (PERF_COUNT_HW_CACHE_RESULT_MISS << 16))
+
+static const struct {
+    uint32_t type;
+    uint64_t config;
+} events[PERF_NR] = {
+    [PERF_CYCLES] = {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+    [PERF_INSTRUCTIONS] = {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+    [PERF_L1D_MISSES] = {PERF_TYPE_HW_CACHE,
+                         CACHE_READ_MISS(PERF_COUNT_HW_CACHE_L1D)},
+    [PERF_LLC_MISSES] = {PERF_TYPE_HW_CACHE,
+                         CACHE_READ_MISS(PERF_COUNT_HW_CACHE_LL)},
+    [PERF_BRANCH_MISSES] = {PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+    [PERF_DTLB_MISSES] = {PERF_TYPE_HW_CACHE,
+                          CACHE_READ_MISS(PERF_COUNT_HW_CACHE_DTLB)},
+};
+
+int perf_open()
+{
+    int opened = 0, err = 0;
+    perf_close();
+    for (int e = 0; e < PERF_NR; e++) {
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = events[e].type;
+        attr.config = events[e].config;
+        /* Counting user space only is allowed with perf_event_paranoid 2 */
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        attr.read_format =
+            PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+        /* Counters are kept separate rather than in a group, so that one
+         * event missing on this CPU does not prevent counting the others.
+         */
+        fds[e] = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+        if (fds[e] < 0)
+            err = errno;
+        else
+            opened++;
+    }
+    if (!opened)
+        errno = err;
+    return opened;
+}
+
+void perf_read(uint64_t counts[PERF_NR])
+{
+    for (int e = 0; e < PERF_NR; e++) {
+        /* Value, time enabled, time running */
+        uint64_t v[3];
+        counts[e] = 0;
+        if (fds[e] < 0 || read(fds[e], v, sizeof(v)) != sizeof(v))
+            continue;
+        counts[e] = v[2] && v[2] < v[1] ? v[0] * ((double) v[1] / v[2]) : v[0];
+    }
+}
+
+#else /* !__linux__ */
+
+int perf_open()
+{
+    errno = ENOSYS;
+    return 0;
+}
+
+void perf_read(uint64_t counts[PERF_NR])
+{
+    memset(counts, 0, PERF_NR * sizeof(uint64_t));
+}
+
+#endif
+
+void perf_close()
+{
+    for (int e = 0; e < PERF_NR; e++) {
+        if (fds[e] >= 0)
+            close(fds[e]);
+        fds[e] = -1;
+    }
+}
+
+bool perf_counting(perf_event_t e)
+{
+    return fds[e] >= 0;
+}
@@ -0,0 +1,34 @@
+#ifndef LAB0_PERF_H
+#define LAB0_PERF_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* Hardware events counted in user space around commands */
+typedef enum {
+    PERF_CYCLES,
+    PERF_INSTRUCTIONS,
+    PERF_L1D_MISSES, /* L1 data cache read misses */
+    PERF_LLC_MISSES, /* Last level cache read misses */
+    PERF_BRANCH_MISSES,
+    PERF_DTLB_MISSES, /* Data TLB read misses */
+    PERF_NR,
+} perf_event_t;
+
+/* Open a counter for every event the kernel lets us count.
+ * Return: number of counters opened, 0 with errno set if none could be
+ */
+int perf_open();
+
+/* Close all counters */
+void perf_close();
+
+/* Whether event @e is being counted */
+bool perf_counting(perf_event_t e);
+
+/* Current value of every counter, scaled up for the time it was not
+ * scheduled on the PMU.  Events not counted read as 0.
+ */
+void perf_read(uint64_t counts[PERF_NR]);
+
+#endif /* LAB0_PERF_H */
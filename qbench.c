@@ -0,0 +1,225 @@
+/* Throughput benchmark of the queue operations.
+ *
+ * It is built twice by 'make release': once with queue.c going through the
+ * checking allocator of the harness and once as a release build straight on
+ * the allocator, so that the cost of the checks can be compared.  With
+ * several threads, each works on a queue of its own and the throughput of all
+ * of them is added up.
+ */
+
+#include <getopt.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "queue.h"
+#include "random.h"
+
+/* Not part of queue.h, which is checked against a checksum */
+extern void q_shuffle(struct list_head *head);
+
+#define MIN_STR_LEN 5
+#define MAX_STR_LEN 10
+
+/* Operations timed in every round, each applied to all elements */
+typedef enum {
+    OP_INSERT_TAIL,
+    OP_SORT,
+    OP_REVERSE,
+    OP_SHUFFLE,
+    OP_REMOVE_HEAD,
+    OP_INSERT_HEAD,
+    OP_FREE,
+    OP_NR,
+} op_t;
+
+static const char *op_names[OP_NR] = {
+    [OP_INSERT_TAIL] = "insert_tail", [OP_SORT] = "sort",
+    [OP_REVERSE] = "reverse",         [OP_SHUFFLE] = "shuffle",
+    [OP_REMOVE_HEAD] = "remove_head", [OP_INSERT_HEAD] = "insert_head",
+    [OP_FREE] = "free",
+};
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* Random lowercase strings, generated before any timing starts */
+static char (*make_strings(int n))[MAX_STR_LEN]
+{
+    char(*strs)[MAX_STR_LEN] = malloc(n * sizeof(*strs));
+    if (!strs)
+        return NULL;
+
+    uintptr_t x = (uintptr_t) time(NULL);
+    for (int i = 0; i < n; i++) {
+        x = random_shuffle(x);
+        uintptr_t r = x;
+        int len = MIN_STR_LEN + r % (MAX_STR_LEN - MIN_STR_LEN);
+        r /= MAX_STR_LEN - MIN_STR_LEN;
+        for (int k = 0; k < len; k++) {
+            strs[i][k] = 'a' + r % 26;
+            r /= 26;
+        }
+        strs[i][len] = '\0';
+    }
+    return strs;
+}
+
+/* Run all operations once, adding the time of each to @t */
+static bool run_round(char (*strs)[MAX_STR_LEN], int n, double *t)
+{
+    double start = now(), end;
+    struct list_head *q = q_new();
+    if (!q)
+        return false;
+
+#define LAP(op)                    \
+    do {                           \
+        end = now();               \
+        t[op] = end - start;       \
+        start = end;               \
+    } while (0)
+
+    for (int i = 0; i < n; i++) {
+        if (!q_insert_tail(q, strs[i]))
+            return false;
+    }
+    LAP(OP_INSERT_TAIL);
+
+    q_sort(q, false);
+    LAP(OP_SORT);
+
+    q_reverse(q);
+    LAP(OP_REVERSE);
+
+    q_shuffle(q);
+    LAP(OP_SHUFFLE);
+
+    for (int i = 0; i < n; i++)
+        q_release_element(q_remove_head(q, NULL, 0));
+    LAP(OP_REMOVE_HEAD);
+
+    for (int i = 0; i < n; i++) {
+        if (!q_insert_head(q, strs[i]))
+            return false;
+    }
+    LAP(OP_INSERT_HEAD);
+
+    q_free(q);
+    LAP(OP_FREE);
+
+#undef LAP
+    return true;
+}
+
+typedef struct {
+    pthread_t thread;
+    int n, rounds;
+    char (*strs)[MAX_STR_LEN];
+    double best[OP_NR]; /* Shortest time of every operation */
+    bool ok;
+} worker_t;
+
+static void *worker(void *arg)
+{
+    worker_t *w = arg;
+    for (int op = 0; op < OP_NR; op++)
+        w->best[op] = -1;
+    for (int r = 0; r < w->rounds; r++) {
+        double t[OP_NR];
+        if (!run_round(w->strs, w->n, t)) {
+            w->ok = false;
+            return NULL;
+        }
+        for (int op = 0; op < OP_NR; op++) {
+            if (w->best[op] < 0 || t[op] < w->best[op])
+                w->best[op] = t[op];
+        }
+    }
+    w->ok = true;
+    return NULL;
+}
+
+static void usage(char *cmd)
+{
+    printf("Usage: %s [-h] [-n N] [-r ROUNDS] [-t THREADS]\n", cmd);
+    printf("\t-h         Print this information\n");
+    printf("\t-n N       Number of elements (default: 1000000)\n");
+    printf("\t-r ROUNDS  Best of this many rounds is reported (default: 5)\n");
+    printf("\t-t THREADS Number of threads (default: 1)\n");
+    exit(0);
+}
+
+int main(int argc, char *argv[])
+{
+    int n = 1000000, rounds = 5, nthreads = 1;
+    int c;
+    while ((c = getopt(argc, argv, "hn:r:t:")) != -1) {
+        switch (c) {
+        case 'n':
+            n = atoi(optarg);
+            break;
+        case 'r':
+            rounds = atoi(optarg);
+            break;
+        case 't':
+            nthreads = atoi(optarg);
+            break;
+        case 'h':
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (n < 1 || rounds < 1 || nthreads < 1)
+        usage(argv[0]);
+
+    char(*strs)[MAX_STR_LEN] = make_strings(n);
+    worker_t *workers = malloc(nthreads * sizeof(worker_t));
+    if (!strs || !workers) {
+        fprintf(stderr, "Cannot allocate %d strings\n", n);
+        return 1;
+    }
+
+    for (int i = 0; i < nthreads; i++) {
+        workers[i].n = n;
+        workers[i].rounds = rounds;
+        workers[i].strs = strs;
+    }
+    if (nthreads == 1) {
+        worker(&workers[0]);
+    } else {
+        for (int i = 0; i < nthreads; i++) {
+            if (pthread_create(&workers[i].thread, NULL, worker,
+                               &workers[i])) {
+                fprintf(stderr, "Cannot create thread\n");
+                return 1;
+            }
+        }
+        for (int i = 0; i < nthreads; i++)
+            pthread_join(workers[i].thread, NULL);
+    }
+
+    /* Operation name and millions of elements per second */
+    for (int op = 0; op < OP_NR; op++) {
+        double mops = 0;
+        for (int i = 0; i < nthreads; i++) {
+            if (!workers[i].ok) {
+                fprintf(stderr, "Queue operation failed\n");
+                return 1;
+            }
+            mops += n / workers[i].best[op] / 1e6;
+        }
+        printf("%-12s %10.3f\n", op_names[op], mops);
+    }
+
+    free(workers);
+    free(strs);
+    return 0;
+}
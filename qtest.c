@@ -1,8 +1,15 @@
 /* Implementation of testing code for queue code */
 
+/* dladdr() */
+#define _GNU_SOURCE
+
 #include <assert.h>
+#include <dlfcn.h>
 #include <errno.h>
 #include <getopt.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <math.h>
 #include <signal.h>
 #include <spawn.h>
 #include <stdio.h>
@@ -28,6 +35,9 @@
 extern double shannon_entropy(const uint8_t *input_data);
 extern int show_entropy;
 
+/* Not part of queue.h, which is checked against a checksum */
+extern void q_shuffle(struct list_head *head);
+
 /* Our program needs to use regular malloc/free */
 #define INTERNAL 1
 #include "harness.h"
@@ -43,8 +53,10 @@ extern int show_entropy;
  * OK as long as head field of queue_t structure is in first position in
  * solution code
  */
+#include "ext_sort.h"
 #include "list_sort.h"
 #include "queue.h"
+#include "sort_stats.h"
 
 #include "console.h"
 #include "report.h"
@@ -55,7 +67,6 @@ extern int show_entropy;
 
 /* How large is a queue before it's considered big.
  * This affects how it gets printed
- * and whether cautious mode is used when freeing the queue
  */
 #define BIG_LIST_SIZE 30
 
@@ -79,6 +90,10 @@ static int descend = 0;
 
 static int use_list_sort = 0;
 
+/* External merge sort spills runs of this many elements to disk */
+static int use_ext_sort = 0;
+static int ext_run_size = 65536;
+
 #define MIN_RANDSTR_LEN 5
 #define MAX_RANDSTR_LEN 10
 static const char charset[] = "abcdefghijklmnopqrstuvwxyz";
@@ -105,9 +120,6 @@ static bool do_free(int argc, char *argv[])
     }
     error_check();
 
-    if (current && current->size > BIG_LIST_SIZE)
-        set_cautious_mode(false);
-
     struct list_head *qnext = NULL;
     if (chain.size > 1) {
         qnext = (current->chain.next == &chain.head) ? chain.head.next
@@ -120,7 +132,6 @@ static bool do_free(int argc, char *argv[])
         if (exception_setup(true))
             q_free(current->q);
         exception_cancel();
-        set_cautious_mode(true);
     }
 
     if (current) {
@@ -172,14 +183,9 @@ static bool do_new(int argc, char *argv[])
  */
 static void fill_rand_string(char *buf, size_t buf_size)
 {
-    size_t len = 0;
-    while (len < MIN_RANDSTR_LEN)
-        len = rand() % buf_size;
-
-    uint64_t randstr_buf_64[MAX_RANDSTR_LEN] = {0};
-    randombytes((uint8_t *) randstr_buf_64, len * sizeof(uint64_t));
+    size_t len = MIN_RANDSTR_LEN + random_bounded(buf_size - MIN_RANDSTR_LEN);
     for (size_t n = 0; n < len; n++)
-        buf[n] = charset[randstr_buf_64[n] % (sizeof(charset) - 1)];
+        buf[n] = charset[random_bounded(sizeof(charset) - 1)];
 
     buf[len] = '\0';
 }
@@ -192,6 +198,8 @@ static bool queue_insert(position_t pos, int argc, char *argv[])
             report(1, "%s does not need arguments in simulation mode", argv[0]);
             return false;
         }
+        /* dudect prints its progress straight to stdout */
+        report_flush(true);
         bool ok =
             pos == POS_TAIL ? is_insert_tail_const() : is_insert_head_const();
         if (!ok) {
@@ -304,6 +312,8 @@ static bool queue_remove(position_t pos, int argc, char *argv[])
             report(1, "%s does not need arguments in simulation mode", argv[0]);
             return false;
         }
+        /* dudect prints its progress straight to stdout */
+        report_flush(true);
         bool ok =
             pos == POS_TAIL ? is_remove_tail_const() : is_remove_head_const();
         if (!ok) {
@@ -580,6 +590,87 @@ static bool do_size(int argc, char *argv[])
     return ok && !error_check();
 }
 
+/* Side table tagging every element with its position before sorting, so that
+ * stability can be verified in a single pass over the sorted queue.  It is an
+ * open addressing hash table keyed on the address of the list node, filled up
+ * to 80%, with keys and 32-bit positions in arrays of their own so that a slot
+ * takes 12 bytes.
+ */
+typedef struct {
+    const struct list_head **nodes;
+    uint32_t *seqs;
+    size_t size;
+} seq_table_t;
+
+static inline size_t seq_slot(const seq_table_t *t,
+                              const struct list_head *node)
+{
+    /* Fibonacci hashing, then the top 32 bits of the product, which are well
+     * mixed, scaled to the table size
+     */
+    uint32_t h = ((uint64_t) (uintptr_t) node * 0x9e3779b97f4a7c15ULL) >> 32;
+    return (size_t) (((uint64_t) h * t->size) >> 32);
+}
+
+static inline size_t seq_next(const seq_table_t *t, size_t i)
+{
+    return ++i == t->size ? 0 : i;
+}
+
+static void seq_table_free(seq_table_t *t)
+{
+    free(t->nodes);
+    free(t->seqs);
+    t->nodes = NULL;
+    t->seqs = NULL;
+}
+
+/* Queues hold at most INT_MAX elements, so that positions fit 32 bits */
+static bool seq_table_init(seq_table_t *t, struct list_head *head, size_t n)
+{
+    t->size = n + n / 4 + 1;
+    t->nodes = calloc(t->size, sizeof(*t->nodes));
+    t->seqs = malloc(t->size * sizeof(*t->seqs));
+    if (!t->nodes || !t->seqs) {
+        seq_table_free(t);
+        return false;
+    }
+
+    uint32_t seq = 0;
+    struct list_head *node;
+    list_for_each (node, head) {
+        size_t i = seq_slot(t, node);
+        while (t->nodes[i])
+            i = seq_next(t, i);
+        t->nodes[i] = node;
+        t->seqs[i] = seq++;
+    }
+    return true;
+}
+
+/* Return the original position of @node, or SIZE_MAX if it was not there */
+static size_t seq_lookup(const seq_table_t *t, const struct list_head *node)
+{
+    for (size_t i = seq_slot(t, node); t->nodes[i]; i = seq_next(t, i)) {
+        if (t->nodes[i] == node)
+            return t->seqs[i];
+    }
+    return SIZE_MAX;
+}
+
+static void list_sort_run(struct list_head *head, bool descend)
+{
+    list_sort(head, descend);
+}
+
+/* Cost of the sort call alone in the last command, without the checks of
+ * do_sort() around it, as shown by 'stats'
+ */
+static struct {
+    uint64_t ns;
+    size_t peak_bytes; /* Allocated on top of the queue at the peak */
+} last_sort;
+
 bool do_sort(int argc, char *argv[])
 {
     if (argc != 1) {
@@ -598,34 +689,69 @@ bool do_sort(int argc, char *argv[])
         report(3, "Warning: Calling sort on single node");
     error_check();
 
-    set_noallocate_mode(true);
-
-/* If the number of elements is too large, it may take a long time to check the
- * stability of the sort. So, MAX_NODES is used to limit the number of elements
- * to check the stability of the sort. */
-#define MAX_NODES 100000
-    struct list_head *nodes[MAX_NODES];
-    unsigned no = 0;
-    if (current && current->size && current->size <= MAX_NODES) {
-        element_t *entry;
-        list_for_each_entry (entry, current->q, list)
-            nodes[no++] = &entry->list;
-    } else if (current && current->size > MAX_NODES)
+    /* Tag the elements with their original positions while allocation is
+     * still allowed.  External sort releases and allocates elements on its
+     * own, so neither the no-allocation check nor the stability check by
+     * address applies to it.
+     */
+    seq_table_t seq_table = {.nodes = NULL};
+    if (!use_ext_sort && current && current->size &&
+        !seq_table_init(&seq_table, current->q, current->size))
         report(1,
                "Warning: Skip checking the stability of the sort because the "
-               "number of elements %d is too large, exceeds the limit %d.",
-               current->size, MAX_NODES);
+               "side table for %d elements could not be allocated.",
+               current->size);
 
+    if (!use_ext_sort)
+        set_noallocate_mode(true);
+
+    bool sorted = true;
+    size_t lost = 0;
+    size_t live = mem_window_start();
+    uint64_t start = time_ns();
     if (current && exception_setup(true)) {
-        if (use_list_sort)
+        if (use_ext_sort)
+            sorted = ext_sort(current->q, descend, ext_run_size,
+                              use_list_sort ? list_sort_run : q_sort, &lost);
+        else if (use_list_sort)
             list_sort(current->q, descend);
         else
             q_sort(current->q, descend);
     }
     exception_cancel();
+    last_sort.ns = time_ns() - start;
     set_noallocate_mode(false);
+    size_t sort_peak = last_sort.peak_bytes = mem_window_peak() - live;
+
+    /* An exception leaves the external sort unfinished */
+    bool stopped = use_ext_sort && ext_sort_stopped(&lost);
+    if (stopped && lost) {
+        report(1,
+               "ERROR: External sort lost %zu of %d elements with its run "
+               "files when it was stopped",
+               lost, cnt);
+        current->size = cnt -= lost;
+    } else if (!stopped && !sorted) {
+        /* The queue is left consistent, but the sort failed */
+        report(1,
+               "ERROR: External sort lost %zu of %d elements, which could not "
+               "be read back from disk or allocated again",
+               lost, cnt);
+        current->size = cnt = q_size(current->q);
+    }
+
+    bool ok = sorted && !stopped;
+    /* The elements of the queue are resident anyway, but those the sort
+     * holds on top of them must fit into the limit
+     */
+    if (use_ext_sort && mblimit > 0 && sort_peak > (size_t) mblimit << 20) {
+        report(1,
+               "ERROR: External sort held %zu bytes beyond the queue, over "
+               "the limit of %d MB",
+               sort_peak, mblimit);
+        ok = false;
+    }
 
-    bool ok = true;
     if (current && current->size) {
         for (struct list_head *cur_l = current->q->next;
              cur_l != current->q && --cnt; cur_l = cur_l->next) {
@@ -633,43 +759,32 @@ bool do_sort(int argc, char *argv[])
             element_t *item, *next_item;
             item = list_entry(cur_l, element_t, list);
             next_item = list_entry(cur_l->next, element_t, list);
-            if (!descend && strcmp(item->value, next_item->value) > 0) {
+            int res = strcmp(item->value, next_item->value);
+            if (!descend && res > 0) {
                 report(1, "ERROR: Not sorted in ascending order");
                 ok = false;
                 break;
             }
 
-            if (descend && strcmp(item->value, next_item->value) < 0) {
+            if (descend && res < 0) {
                 report(1, "ERROR: Not sorted in descending order");
                 ok = false;
                 break;
             }
             /* Ensure the stability of the sort */
-            if (current->size <= MAX_NODES &&
-                !strcmp(item->value, next_item->value)) {
-                bool unstable = false;
-                for (unsigned i = 0; i < MAX_NODES; i++) {
-                    if (nodes[i] == cur_l->next) {
-                        unstable = true;
-                        break;
-                    }
-                    if (nodes[i] == cur_l) {
-                        break;
-                    }
-                }
-                if (unstable) {
-                    report(
-                        1,
-                        "ERROR: Not stable sort. The duplicate strings \"%s\" "
-                        "are not in the same order.",
-                        item->value);
-                    ok = false;
-                    break;
-                }
+            if (seq_table.nodes && !res &&
+                seq_lookup(&seq_table, cur_l) >
+                    seq_lookup(&seq_table, cur_l->next)) {
+                report(1,
+                       "ERROR: Not stable sort. The duplicate strings \"%s\" "
+                       "are not in the same order.",
+                       item->value);
+                ok = false;
+                break;
             }
         }
     }
-#undef MAX_NODES
+    seq_table_free(&seq_table);
 
     q_show(3);
     return ok && !error_check();
@@ -921,26 +1036,619 @@ static bool do_merge(int argc, char *argv[])
     return ok && !error_check();
 }
 
-// static bool do_shuffle(int argc, char *argv[])
-// {
-//     if (argc != 1) {
-//         report(1, "%s takes no arguments", argv[0]);
-//         return false;
-//     }
+#ifdef SORT_STATS
+sort_stats_t sort_stats;
+#endif
 
-//     if (!current || !current->q) {
-//         report(3, "Warning: Try to access null queue");
-//         return false;
-//     }
-//     error_check();
+/* Counters describe the most recent command other than 'stats' itself */
+static void reset_sort_stats(int argc, char *argv[])
+{
+    if (!strcmp(argv[0], "stats"))
+        return;
+    memset(&last_sort, 0, sizeof(last_sort));
+#ifdef SORT_STATS
+    memset(&sort_stats, 0, sizeof(sort_stats));
+#endif
+}
 
-//     if (exception_setup(true))
-//         q_shuffle(current->q);
-//     exception_cancel();
+static bool do_stats(int argc, char *argv[])
+{
+    if (argc != 1) {
+        report(1, "%s takes no arguments", argv[0]);
+        return false;
+    }
 
-//     q_show(3);
-//     return !error_check();
-// }
+    report(1, "Sort time = %.9f", last_sort.ns * 1e-9);
+    report(1, "Sort peak bytes = %zu", last_sort.peak_bytes);
+#ifdef SORT_STATS
+    report(1, "Comparisons = %" PRIu64, sort_stats.cmps);
+    report(1, "Bytes compared = %" PRIu64, sort_stats.cmp_bytes);
+    report(1, "Link writes = %" PRIu64, sort_stats.link_writes);
+    report(1, "Merge calls = %" PRIu64, sort_stats.merge_calls);
+#else
+    report(1, "Comparisons are not counted.  Rebuild with SORT_STATS=1");
+#endif
+    return true;
+}
+
+/* Allocations of every command, for its allocation rate */
+typedef struct {
+    char *name;
+    uint64_t calls, allocs, bytes;
+    double seconds;
+} cmd_memstat_t;
+
+#define MAX_CMD_MEMSTATS 64
+static cmd_memstat_t cmd_memstats[MAX_CMD_MEMSTATS];
+static int cmd_memstat_cnt = 0;
+
+/* Profiling every command costs two clock readings, so it is opt-in */
+static int cmd_memstat_on = 0;
+
+/* Counters when the commands being run started, innermost last */
+#define MAX_CMD_DEPTH 8
+static struct {
+    bool taken; /* Not if profiling was off when the command started */
+    uint64_t allocs, bytes;
+    double start;
+} cmd_marks[MAX_CMD_DEPTH];
+static int cmd_depth = 0;
+
+static double monotonic_time()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void memstat_cmd_start(int argc, char *argv[])
+{
+    if (cmd_depth++ >= MAX_CMD_DEPTH)
+        return;
+
+    cmd_marks[cmd_depth - 1].taken = cmd_memstat_on;
+    if (!cmd_memstat_on)
+        return;
+    mem_thread_totals(&cmd_marks[cmd_depth - 1].allocs,
+                      &cmd_marks[cmd_depth - 1].bytes);
+    cmd_marks[cmd_depth - 1].start = monotonic_time();
+}
+
+static void memstat_cmd_end(int argc, char *argv[])
+{
+    if (--cmd_depth >= MAX_CMD_DEPTH || !cmd_marks[cmd_depth].taken)
+        return;
+
+    int i;
+    for (i = 0; i < cmd_memstat_cnt; i++) {
+        if (!strcmp(cmd_memstats[i].name, argv[0]))
+            break;
+    }
+    if (i == cmd_memstat_cnt) {
+        if (i == MAX_CMD_MEMSTATS)
+            return;
+        cmd_memstats[i].name = strdup(argv[0]);
+        if (!cmd_memstats[i].name)
+            return;
+        cmd_memstat_cnt++;
+    }
+
+    uint64_t allocs, bytes;
+    mem_thread_totals(&allocs, &bytes);
+    cmd_memstat_t *c = &cmd_memstats[i];
+    c->calls++;
+    c->allocs += allocs - cmd_marks[cmd_depth].allocs;
+    c->bytes += bytes - cmd_marks[cmd_depth].bytes;
+    c->seconds += monotonic_time() - cmd_marks[cmd_depth].start;
+}
+
+static void free_cmd_memstats()
+{
+    for (int i = 0; i < cmd_memstat_cnt; i++)
+        free(cmd_memstats[i].name);
+    cmd_memstat_cnt = 0;
+}
+
+/* Name a call site after the symbol or the module containing it */
+static void site_name(const void *site, char *buf, size_t size)
+{
+    Dl_info info;
+    if (!site)
+        snprintf(buf, size, "(other)");
+    else if (dladdr(site, &info) && info.dli_sname)
+        snprintf(buf, size, "%s+%#tx", info.dli_sname,
+                 (const char *) site - (const char *) info.dli_saddr);
+    else if (dladdr(site, &info) && info.dli_fname)
+        snprintf(buf, size, "%s+%#tx", info.dli_fname,
+                 (const char *) site - (const char *) info.dli_fbase);
+    else
+        snprintf(buf, size, "%p", site);
+}
+
+#define MEMSTAT_SITES 16
+
+static bool do_memstat(int argc, char *argv[])
+{
+    bool json = argc == 2 && !strcmp(argv[1], "json");
+    if (argc > 2 || (argc == 2 && !json)) {
+        report(1, "%s takes no arguments or 'json'", argv[0]);
+        return false;
+    }
+
+    mem_stats_t s;
+    mem_stats(&s);
+    mem_site_t sites[MEMSTAT_SITES];
+    size_t nsites = mem_sites(sites, MEMSTAT_SITES);
+    char name[256];
+
+    if (!json) {
+        report(1, "Allocations = %" PRIu64 ", frees = %" PRIu64
+               ", bytes = %" PRIu64, s.allocs, s.frees, s.bytes);
+        report(1, "Live blocks = %" PRIu64 ", live bytes = %" PRIu64
+               ", peak bytes = %" PRIu64, s.live_blocks, s.live_bytes,
+               s.peak_bytes);
+        report(1, "Allocation sizes:");
+        for (int i = 0; i < MEM_HIST_BUCKETS; i++) {
+            if (!s.size_hist[i])
+                continue;
+            uint64_t lo = i ? (uint64_t) 1 << (i - 1) : 0;
+            uint64_t hi = i ? (lo << 1) - 1 : 0;
+            report(1, "  %10" PRIu64 " - %-10" PRIu64 " %12" PRIu64, lo, hi,
+                   s.size_hist[i]);
+        }
+        report(1, "Call sites:");
+        for (size_t i = 0; i < nsites; i++) {
+            site_name(sites[i].site, name, sizeof(name));
+            report(1,
+                   "  %-32s allocs %" PRIu64 ", bytes %" PRIu64
+                   ", live blocks %" PRIu64 ", live bytes %" PRIu64,
+                   name, sites[i].allocs, sites[i].bytes,
+                   sites[i].live_blocks, sites[i].live_bytes);
+        }
+        report(1, "Commands:");
+        for (int i = 0; i < cmd_memstat_cnt; i++) {
+            cmd_memstat_t *c = &cmd_memstats[i];
+            report(1,
+                   "  %-10s calls %" PRIu64 ", allocs %" PRIu64
+                   ", bytes %" PRIu64 ", %.0f allocs/s",
+                   c->name, c->calls, c->allocs, c->bytes,
+                   c->seconds > 0 ? c->allocs / c->seconds : 0);
+        }
+        return true;
+    }
+
+    report_noreturn(1,
+                    "{\"allocs\": %" PRIu64 ", \"frees\": %" PRIu64
+                    ", \"bytes\": %" PRIu64 ", \"live_blocks\": %" PRIu64
+                    ", \"live_bytes\": %" PRIu64 ", \"peak_bytes\": %" PRIu64,
+                    s.allocs, s.frees, s.bytes, s.live_blocks, s.live_bytes,
+                    s.peak_bytes);
+    report_noreturn(1, ", \"sizes\": [");
+    const char *sep = "";
+    for (int i = 0; i < MEM_HIST_BUCKETS; i++) {
+        if (!s.size_hist[i])
+            continue;
+        uint64_t lo = i ? (uint64_t) 1 << (i - 1) : 0;
+        uint64_t hi = i ? (lo << 1) - 1 : 0;
+        report_noreturn(1,
+                        "%s{\"min\": %" PRIu64 ", \"max\": %" PRIu64
+                        ", \"allocs\": %" PRIu64 "}",
+                        sep, lo, hi, s.size_hist[i]);
+        sep = ", ";
+    }
+    report_noreturn(1, "], \"sites\": [");
+    for (size_t i = 0; i < nsites; i++) {
+        site_name(sites[i].site, name, sizeof(name));
+        report_noreturn(1,
+                        "%s{\"site\": \"%s\", \"allocs\": %" PRIu64
+                        ", \"bytes\": %" PRIu64 ", \"live_blocks\": %" PRIu64
+                        ", \"live_bytes\": %" PRIu64 "}",
+                        i ? ", " : "", name, sites[i].allocs, sites[i].bytes,
+                        sites[i].live_blocks, sites[i].live_bytes);
+    }
+    report_noreturn(1, "], \"commands\": [");
+    for (int i = 0; i < cmd_memstat_cnt; i++) {
+        cmd_memstat_t *c = &cmd_memstats[i];
+        report_noreturn(1,
+                        "%s{\"name\": \"%s\", \"calls\": %" PRIu64
+                        ", \"allocs\": %" PRIu64 ", \"bytes\": %" PRIu64
+                        ", \"seconds\": %.6f}",
+                        i ? ", " : "", c->name, c->calls, c->allocs, c->bytes,
+                        c->seconds);
+    }
+    report(1, "]}");
+    return true;
+}
+
+/* Input distributions produced by 'gen' for sort benchmarks and workloads */
+typedef enum {
+    GEN_RANDOM,    /* Random lowercase strings */
+    GEN_SORTED,    /* Ascending zero-padded numbers */
+    GEN_REVERSE,   /* Descending zero-padded numbers */
+    GEN_SAWTOOTH,  /* Ascending runs of param elements */
+    GEN_FEWUNIQUE, /* Uniform over param distinct strings */
+    GEN_PREFIX,    /* Random strings behind a common prefix of param bytes */
+    GEN_ZIPF,      /* Zipf over a vocabulary of param strings */
+    GEN_LENHIST,   /* Random strings with lengths drawn from a histogram */
+    GEN_NR,
+} gen_dist_t;
+
+static const struct {
+    const char *name;
+    int param; /* Used when the command gives none */
+} gen_dists[GEN_NR] = {
+    [GEN_RANDOM] = {"random", 0},       [GEN_SORTED] = {"sorted", 0},
+    [GEN_REVERSE] = {"reverse", 0},     [GEN_SAWTOOTH] = {"sawtooth", 1000},
+    [GEN_FEWUNIQUE] = {"fewunique", 8}, [GEN_PREFIX] = {"prefix", 64},
+    [GEN_ZIPF] = {"zipf", 10000},       [GEN_LENHIST] = {"lenhist", 0},
+};
+
+#define GEN_MAXLEN MAXSTRING
+
+/* Strings are generated in batches packed into a buffer, and only then
+ * inserted, so that the generator runs in a tight loop of its own
+ */
+#define GEN_BATCH_BYTES (64 * 1024)
+
+/* Walker's alias method: drawing from a discrete distribution costs a random
+ * number and a table lookup, whatever the number of outcomes
+ */
+typedef struct {
+    int n;
+    uint64_t *cut; /* Outcome i below cut[i] out of 2^32, else alias[i] */
+    int *alias;
+} gen_alias_t;
+
+typedef struct {
+    gen_dist_t dist;
+    int param;
+    char (*vocab)[MAX_RANDSTR_LEN]; /* Distinct strings of few-unique/Zipf */
+    gen_alias_t pick;               /* Zipf rank or histogram bin */
+    int *lens;                      /* Length of every histogram bin */
+} gen_t;
+
+/* Same shape as fill_rand_string(), drawn from a single random number */
+static void gen_rand_string(char *buf)
+{
+    uint64_t r = random_u64();
+    size_t len = MIN_RANDSTR_LEN + r % (MAX_RANDSTR_LEN - MIN_RANDSTR_LEN);
+    r /= MAX_RANDSTR_LEN - MIN_RANDSTR_LEN;
+    for (size_t n = 0; n < len; n++) {
+        buf[n] = charset[r % (sizeof(charset) - 1)];
+        r /= sizeof(charset) - 1;
+    }
+    buf[len] = '\0';
+}
+
+/* @len random lowercase letters, 8 from every random number so that the
+ * last of them is biased by less than 1e-7
+ */
+static void gen_rand_chars(char *buf, int len)
+{
+    while (len > 0) {
+        uint64_t r = random_u64();
+        for (int k = 0; k < 8 && len > 0; k++, len--) {
+            *buf++ = charset[r % (sizeof(charset) - 1)];
+            r /= sizeof(charset) - 1;
+        }
+    }
+    *buf = '\0';
+}
+
+/* Zero-padded decimal of @v in 10 digits, as "%010d" but much faster */
+static void gen_put_dec(char *buf, unsigned v)
+{
+    for (int k = 9; k >= 0; k--) {
+        buf[k] = '0' + v % 10;
+        v /= 10;
+    }
+    buf[10] = '\0';
+}
+
+static void alias_destroy(gen_alias_t *a)
+{
+    free(a->cut);
+    free(a->alias);
+}
+
+/* Build the table drawing outcome i with a probability proportional to
+ * @w[i] >= 0, by Vose's method
+ */
+static bool alias_init(gen_alias_t *a, const double *w, int n)
+{
+    a->n = n;
+    a->cut = malloc(n * sizeof(*a->cut));
+    a->alias = malloc(n * sizeof(*a->alias));
+    double *p = malloc(n * sizeof(*p));
+    int *work = malloc(n * sizeof(*work)); /* Small from 0, large from n */
+    if (!a->cut || !a->alias || !p || !work) {
+        alias_destroy(a);
+        free(p);
+        free(work);
+        return false;
+    }
+
+    double sum = 0;
+    for (int i = 0; i < n; i++)
+        sum += w[i];
+    int small = 0, large = n;
+    for (int i = 0; i < n; i++) {
+        p[i] = w[i] * n / sum;
+        if (p[i] < 1)
+            work[small++] = i;
+        else
+            work[--large] = i;
+    }
+    while (small && large < n) {
+        int s = work[--small], l = work[large++];
+        a->cut[s] = (uint64_t) (p[s] * 0x1.0p32);
+        a->alias[s] = l;
+        p[l] -= 1 - p[s];
+        if (p[l] < 1)
+            work[small++] = l;
+        else
+            work[--large] = l;
+    }
+    /* Left over only from rounding: always their own outcome */
+    while (small)
+        a->cut[work[--small]] = 1ULL << 32;
+    while (large < n)
+        a->cut[work[large++]] = 1ULL << 32;
+
+    free(p);
+    free(work);
+    return true;
+}
+
+static inline int alias_draw(const gen_alias_t *a)
+{
+    int i = random_bounded(a->n);
+    return (random_u64() >> 32) < a->cut[i] ? i : a->alias[i];
+}
+
+/* Parse "len:weight,..." of a length histogram into @g */
+static bool gen_parse_hist(gen_t *g, const char *spec)
+{
+    int n = 1;
+    for (const char *s = spec; *s; s++)
+        n += *s == ',';
+    g->lens = malloc(n * sizeof(*g->lens));
+    double *w = malloc(n * sizeof(*w));
+    bool ok = g->lens && w;
+
+    double sum = 0;
+    const char *s = spec;
+    for (int k = 0; ok && k < n; k++) {
+        char *end;
+        long len = strtol(s, &end, 10);
+        ok = end != s && *end == ':' && len >= 0 && len < GEN_MAXLEN;
+        if (!ok)
+            break;
+        s = end + 1;
+        w[k] = strtod(s, &end);
+        ok = end != s && w[k] >= 0 && *end == (k < n - 1 ? ',' : '\0');
+        g->lens[k] = len;
+        sum += w[k];
+        s = end + 1;
+    }
+    ok = ok && sum > 0 && alias_init(&g->pick, w, n);
+    free(w);
+    if (!ok) {
+        free(g->lens);
+        g->lens = NULL;
+    }
+    return ok;
+}
+
+static void gen_destroy(gen_t *g)
+{
+    free(g->vocab);
+    free(g->lens);
+    if (g->dist == GEN_ZIPF || g->dist == GEN_LENHIST)
+        alias_destroy(&g->pick);
+}
+
+/* Set up @g for the distribution @dist, with parameter @param, Zipf exponent
+ * @skew, and the histogram @hist of lenhist
+ */
+static bool gen_init(gen_t *g,
+                     gen_dist_t dist,
+                     int param,
+                     double skew,
+                     const char *hist)
+{
+    g->dist = dist;
+    g->param = param;
+    g->vocab = NULL;
+    g->lens = NULL;
+    if (dist == GEN_LENHIST)
+        return gen_parse_hist(g, hist);
+    if (dist != GEN_FEWUNIQUE && dist != GEN_ZIPF)
+        return true;
+
+    g->vocab = malloc(param * sizeof(*g->vocab));
+    if (!g->vocab)
+        return false;
+    for (int k = 0; k < param; k++)
+        gen_rand_string(g->vocab[k]);
+    if (dist == GEN_FEWUNIQUE)
+        return true;
+
+    double *w = malloc(param * sizeof(*w));
+    bool ok = w;
+    if (ok) {
+        for (int k = 0; k < param; k++)
+            w[k] = pow(k + 1, -skew);
+        ok = alias_init(&g->pick, w, param);
+    }
+    free(w);
+    if (!ok)
+        free(g->vocab);
+    return ok;
+}
+
+/* Write element @i out of @n into @buf.
+ *
+ * Return: length of the string
+ */
+static int gen_string(const gen_t *g, int i, int n, char *buf)
+{
+    switch (g->dist) {
+    case GEN_RANDOM:
+        gen_rand_string(buf);
+        break;
+    case GEN_SORTED:
+        gen_put_dec(buf, i);
+        return 10;
+    case GEN_REVERSE:
+        gen_put_dec(buf, n - 1 - i);
+        return 10;
+    case GEN_SAWTOOTH:
+        gen_put_dec(buf, i % g->param);
+        return 10;
+    case GEN_FEWUNIQUE:
+        strcpy(buf, g->vocab[random_bounded(g->param)]);
+        break;
+    case GEN_PREFIX:
+        memset(buf, 'p', g->param);
+        gen_rand_string(buf + g->param);
+        break;
+    case GEN_ZIPF:
+        strcpy(buf, g->vocab[alias_draw(&g->pick)]);
+        break;
+    case GEN_LENHIST: {
+        int len = g->lens[alias_draw(&g->pick)];
+        gen_rand_chars(buf, len);
+        return len;
+    }
+    default:
+        buf[0] = '\0';
+        break;
+    }
+    return strlen(buf);
+}
+
+static bool do_gen(int argc, char *argv[])
+{
+    if (argc < 3 || argc > 5) {
+        report(1, "%s needs 2-4 arguments", argv[0]);
+        return false;
+    }
+
+    gen_dist_t dist;
+    for (dist = 0; dist < GEN_NR; dist++) {
+        if (!strcmp(argv[1], gen_dists[dist].name))
+            break;
+    }
+    if (dist == GEN_NR) {
+        report(1, "Unknown distribution '%s'", argv[1]);
+        return false;
+    }
+
+    int n, param = gen_dists[dist].param;
+    double skew = 1;
+    const char *hist = NULL;
+    if (!get_int(argv[2], &n) || n < 0) {
+        report(1, "Invalid number of elements '%s'", argv[2]);
+        return false;
+    }
+    if (dist == GEN_LENHIST) {
+        if (argc != 4) {
+            report(1, "lenhist needs a histogram of len:weight,...");
+            return false;
+        }
+        hist = argv[3];
+    } else if (argc >= 4) {
+        int max = dist == GEN_PREFIX ? GEN_MAXLEN - MAX_RANDSTR_LEN : INT_MAX;
+        if (!get_int(argv[3], &param) || param < 1 || param > max) {
+            report(1, "Invalid parameter '%s'", argv[3]);
+            return false;
+        }
+    }
+    if (argc == 5) {
+        char *end;
+        skew = strtod(argv[4], &end);
+        if (dist != GEN_ZIPF || *end || skew < 0) {
+            report(1, "Invalid Zipf exponent '%s'", argv[4]);
+            return false;
+        }
+    }
+
+    if (!current || !current->q) {
+        report(3, "Warning: Calling gen on null queue");
+        return false;
+    }
+    error_check();
+
+    gen_t g;
+    if (!gen_init(&g, dist, param, skew, hist)) {
+        if (dist == GEN_LENHIST)
+            report(1, "Invalid histogram '%s'", argv[3]);
+        else
+            report(1, "ERROR: Could not allocate vocabulary of %d strings",
+                   param);
+        return false;
+    }
+
+    /* An element and its string for every one */
+    alloc_reserve(2 * (size_t) n);
+
+    char *batch = malloc(GEN_BATCH_BYTES);
+    if (!batch) {
+        gen_destroy(&g);
+        report(1, "ERROR: Could not allocate generation buffer");
+        return false;
+    }
+
+    bool ok = true;
+    if (exception_setup(true)) {
+        for (int i = 0; ok && i < n;) {
+            /* Fill the buffer while the longest string still fits */
+            size_t used = 0;
+            int end = i;
+            for (; end < n && used <= GEN_BATCH_BYTES - GEN_MAXLEN; end++)
+                used += gen_string(&g, end, n, batch + used) + 1;
+
+            for (char *s = batch; ok && i < end; s += strlen(s) + 1, i++) {
+                if (!q_insert_tail(current->q, s)) {
+                    report(1, "ERROR: Insertion of %s failed", s);
+                    ok = false;
+                } else {
+                    current->size++;
+                }
+            }
+        }
+    }
+    exception_cancel();
+    free(batch);
+    gen_destroy(&g);
+
+    q_show(3);
+    return ok && !error_check();
+}
+
+static bool do_shuffle(int argc, char *argv[])
+{
+    if (argc != 1) {
+        report(1, "%s takes no arguments", argv[0]);
+        return false;
+    }
+
+    if (!current || !current->q) {
+        report(3, "Warning: Try to access null queue");
+        return false;
+    }
+    error_check();
+
+    set_noallocate_mode(true);
+    if (exception_setup(true))
+        q_shuffle(current->q);
+    exception_cancel();
+    set_noallocate_mode(false);
+
+    q_show(3);
+    return !error_check();
+}
 
 static bool is_circular()
 {
@@ -1085,6 +1793,23 @@ static bool do_next(int argc, char *argv[])
     return q_show(0);
 }
 
+/* Any change of the fault injection settings restarts its schedule */
+static void fault_setter(int oldval)
+{
+    int seed = fail_seed;
+    reset_fault_injection();
+    if (fail_seed != seed)
+        report(1, "Fault injection seed = %d", fail_seed);
+}
+
+static void poison_setter(int oldval)
+{
+    if (poison_mode < POISON_OFF || poison_mode > POISON_SAMPLED) {
+        report(1, "Unknown poison mode %d", poison_mode);
+        poison_mode = oldval;
+    }
+}
+
 static void console_init()
 {
     ADD_COMMAND(new, "Create new queue", "");
@@ -1125,12 +1850,36 @@ static void console_init()
                 "");
     ADD_COMMAND(reverseK, "Reverse the nodes of the queue 'K' at a time",
                 "[K]");
+    ADD_COMMAND(memstat,
+                "Show allocation counts, sizes, call sites, live and peak "
+                "bytes, and with option cmdmem allocations of every command",
+                "[json]");
+    ADD_COMMAND(gen,
+                "Insert n strings of distribution dist at tail of queue: "
+                "random, sorted, reverse, sawtooth (run length p), fewunique "
+                "(p keys), prefix (p bytes shared), zipf (p words, exponent "
+                "s) or lenhist (p as len:weight,... of string lengths)",
+                "dist n [p [s]]");
+    ADD_COMMAND(stats,
+                "Show time and peak memory of the sort alone, comparisons, "
+                "bytes compared, link writes and merge calls of the last "
+                "command",
+                "");
 
-    // ADD_COMMAND(shuffle, "Shuffle the nodes in random sequences", "");
+    ADD_COMMAND(shuffle, "Shuffle the nodes in random sequences", "");
     add_param("length", &string_length, "Maximum length of displayed string",
               NULL);
     add_param("malloc", &fail_probability, "Malloc failure probability percent",
-              NULL);
+              fault_setter);
+    add_param("failseed", &fail_seed,
+              "Seed of random malloc failures (0 = pick one)", fault_setter);
+    add_param("failnth", &fail_nth, "Fail the nth malloc (0 = none)",
+              fault_setter);
+    add_param("failevery", &fail_every, "Fail every nth malloc (0 = none)",
+              fault_setter);
+    add_param("failabove", &fail_above,
+              "Fail mallocs larger than this many bytes (0 = none)",
+              fault_setter);
     add_param("fail", &fail_limit,
               "Number of times allow queue operations to return false", NULL);
     add_param("descend", &descend,
@@ -1138,12 +1887,36 @@ static void console_init()
     add_param("listsort", &use_list_sort,
               "use linux kernel style sorting algorithm from lib/list_sort.c",
               NULL);
+    add_param("extsort", &use_ext_sort,
+              "Sort by spilling sorted runs to temporary files", NULL);
+    add_param("runsize", &ext_run_size,
+              "Number of elements sorted in memory per run of external sort",
+              NULL);
+    add_param("mblimit", &mblimit,
+              "Memory limit in megabytes for internal buffers (0 = unlimited)",
+              NULL);
+    add_param("cmdmem", &cmd_memstat_on,
+              "Profile allocations and time of every command for memstat",
+              NULL);
+    add_param("poison", &poison_mode,
+              "Fill payloads on malloc and free: 0 = off, 1 = fully, "
+              "2 = first and last bytes, 3 = every nth block",
+              poison_setter);
+    add_param("poisonevery", &poison_every,
+              "Blocks per filled one with poison 3", NULL);
+    add_param("guardabove", &guard_above,
+              "Put mallocs larger than this many bytes against a guard page "
+              "(0 = none)",
+              NULL);
+    add_param("timelimit", &time_limit,
+              "Seconds a queue operation may run (0 = unlimited)", NULL);
 }
 
 /* Signal handlers */
 static void sigsegv_handler(int sig)
 {
     /* Avoid possible non-reentrant signal function be used in signal handler */
+    report_salvage();
     assert(write(1,
                  "Segmentation fault occurred.  You dereferenced a NULL or "
                  "invalid pointer",
@@ -1170,8 +1943,6 @@ static void q_init()
 static bool q_quit(int argc, char *argv[])
 {
     report(3, "Freeing queue");
-    if (current && current->size > BIG_LIST_SIZE)
-        set_cautious_mode(false);
 
     if (exception_setup(true)) {
         struct list_head *cur = chain.head.next;
@@ -1185,7 +1956,6 @@ static bool q_quit(int argc, char *argv[])
     }
 
     exception_cancel();
-    set_cautious_mode(true);
 
     size_t bcnt = allocation_check();
     if (bcnt > 0) {
@@ -1199,11 +1969,17 @@ static bool q_quit(int argc, char *argv[])
 
 static void usage(char *cmd)
 {
-    printf("Usage: %s [-h] [-f IFILE][-v VLEVEL][-l LFILE]\n", cmd);
+    printf("Usage: %s [-h] [-f IFILE | -b BFILE][-v VLEVEL][-l LFILE]"
+           "[-s SEED]\n",
+           cmd);
+    printf("       %s -c IFILE -o BFILE\n", cmd);
     printf("\t-h         Print this information\n");
     printf("\t-f IFILE   Read commands from IFILE\n");
+    printf("\t-b BFILE   Replay commands compiled into BFILE\n");
+    printf("\t-c IFILE   Compile commands of IFILE into BFILE given by -o\n");
     printf("\t-v VLEVEL  Set verbosity level\n");
     printf("\t-l LFILE   Echo results to LFILE\n");
+    printf("\t-s SEED    Seed random strings and shuffles to repeat a run\n");
     exit(0);
 }
 
@@ -1413,10 +2189,13 @@ int main(int argc, char *argv[])
     char *infile_name = NULL;
     char lbuf[BUFSIZE];
     char *logfile_name = NULL;
+    char *compile_name = NULL, *output_name = NULL, *compiled_name = NULL;
     int level = 4;
+    unsigned long long seed = 0;
+    bool has_seed = false;
     int c;
 
-    while ((c = getopt(argc, argv, "hv:f:l:")) != -1) {
+    while ((c = getopt(argc, argv, "hv:f:l:b:c:o:s:")) != -1) {
         switch (c) {
         case 'h':
             usage(argv[0]);
@@ -1441,6 +2220,26 @@ int main(int argc, char *argv[])
             buf[BUFSIZE - 1] = '\0';
             logfile_name = lbuf;
             break;
+        case 'b':
+            compiled_name = optarg;
+            break;
+        case 'c':
+            compile_name = optarg;
+            break;
+        case 'o':
+            output_name = optarg;
+            break;
+        case 's': {
+            char *endptr;
+            errno = 0;
+            seed = strtoull(optarg, &endptr, 0);
+            if (errno != 0 || endptr == optarg || *endptr) {
+                fprintf(stderr, "Invalid seed\n");
+                exit(EXIT_FAILURE);
+            }
+            has_seed = true;
+            break;
+        }
         default:
             printf("Unknown option '%c'\n", c);
             usage(argv[0]);
@@ -1449,16 +2248,30 @@ int main(int argc, char *argv[])
     }
 
     /* A better seed can be obtained by combining getpid() and its parent ID
-     * with the Unix time.
+     * with the Unix time.  A seed given makes random strings, shuffles and
+     * the pick of the fault injection seed repeatable.
      */
-    srand(os_random(getpid() ^ getppid()));
+    if (has_seed) {
+        random_seed(seed);
+        srand(seed);
+    } else {
+        srand(os_random(getpid() ^ getppid()));
+    }
+
+    if ((compile_name && !output_name) || (compiled_name && infile_name))
+        usage(argv[0]);
 
     q_init();
     init_cmd();
     console_init();
 
+    if (compile_name) {
+        set_verblevel(level);
+        return !compile_cmd_file(compile_name, output_name);
+    }
+
     /* Initialize linenoise only when infile_name not exist */
-    if (!infile_name) {
+    if (!infile_name && !compiled_name) {
         /* Trigger call back function(auto completion) */
         line_set_completion_callback(completion);
 
@@ -1473,12 +2286,19 @@ int main(int argc, char *argv[])
         set_logfile(logfile_name);
 
     add_quit_helper(q_quit);
+    add_cmd_hook(reset_sort_stats);
+    add_cmd_hook(memstat_cmd_start);
+    add_cmd_post_hook(memstat_cmd_end);
 
     bool ok = true;
-    ok = ok && run_console(infile_name);
+    if (compiled_name)
+        ok = ok && run_console_compiled(compiled_name);
+    else
+        ok = ok && run_console(infile_name);
 
     /* Do finish_cmd() before check whether ok is true or false */
     ok = finish_cmd() && ok;
+    free_cmd_memstats();
 
     return !ok;
 }
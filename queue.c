@@ -4,6 +4,8 @@
 #include <time.h>
 
 #include "queue.h"
+#include "random.h"
+#include "sort_stats.h"
 
 static inline int q_cmp(bool descend,
                         const struct list_head *a,
@@ -11,7 +13,7 @@ static inline int q_cmp(bool descend,
 {
     const element_t *ea = list_entry(a, element_t, list);
     const element_t *eb = list_entry(b, element_t, list);
-    int cmp_res = strcmp(ea->value, eb->value);
+    int cmp_res = SORT_STRCMP(ea->value, eb->value);
     return descend ? -cmp_res : cmp_res;
 }
 
@@ -258,6 +260,7 @@ static struct list_head *merge_two_sorted_list(bool descend,
     struct list_head guard;
     struct list_head *tail = &guard;
 
+    SORT_STAT_ADD(merge_calls, 1);
     while (a && b) {
         if (q_cmp(descend, a, b) <= 0) {
             tail->next = a;
@@ -270,8 +273,10 @@ static struct list_head *merge_two_sorted_list(bool descend,
             tail = b;
             b = b->next;
         }
+        SORT_STAT_ADD(link_writes, 2);
     }
 
+    SORT_STAT_ADD(link_writes, 2);
     if (a) {
         tail->next = a;
         a->prev = tail;
@@ -370,6 +375,109 @@ int q_merge(struct list_head *head, bool descend)
     return q_size(ans_entry->q);
 }
 
+/* Queues shorter than this are always merge sorted.  Only this many elements
+ * at the front are sampled, so that queues with many distinct strings do not
+ * pay for walks over the whole queue before being merge sorted.
+ */
+#define FEW_KEYS_MIN_SIZE 1024
+/* Number of evenly spaced elements of the front inspected */
+#define FEW_KEYS_SAMPLES 64
+/* Largest number of distinct samples for which partitioning is tried */
+#define FEW_KEYS_SAMPLE_LIMIT 8
+/* Largest number of distinct strings partitioning can handle */
+#define FEW_KEYS_MAX 16
+
+/* Estimate from the front of the queue whether it holds only a handful of
+ * distinct strings.  A wrong guess costs the partitioning pass up to the
+ * point where more than FEW_KEYS_MAX strings show up.
+ */
+static bool q_has_few_keys(struct list_head *head)
+{
+    const char *keys[FEW_KEYS_SAMPLE_LIMIT];
+    int nkeys = 0, i = 0;
+    const int stride = FEW_KEYS_MIN_SIZE / FEW_KEYS_SAMPLES;
+    struct list_head *node;
+
+    for (node = head->next; i < FEW_KEYS_MIN_SIZE; node = node->next, i++) {
+        if (node == head)
+            return false;
+        if (i % stride)
+            continue;
+        const char *s = list_entry(node, element_t, list)->value;
+        int k = 0;
+        while (k < nkeys && SORT_STRCMP(s, keys[k]))
+            k++;
+        if (k < nkeys)
+            continue;
+        if (nkeys == FEW_KEYS_SAMPLE_LIMIT)
+            return false;
+        keys[nkeys++] = s;
+    }
+    return true;
+}
+
+/* Stable sort for queues with few distinct strings.  A single pass moves
+ * every element to the tail of the sublist holding its string, so equal
+ * strings keep their order, and the sublists are concatenated in key order.
+ * Each element costs one string comparison when it repeats the string of its
+ * predecessor, which is the common case, instead of ~log(n) in merge sort.
+ *
+ * Return: false if more than FEW_KEYS_MAX distinct strings show up.  The
+ * elements already partitioned are then put back in front of the rest, which
+ * keeps equal strings in their original order for a general sort.
+ */
+static bool q_sort_few_keys(struct list_head *head, bool descend)
+{
+    struct {
+        const char *key;
+        struct list_head list;
+    } part[FEW_KEYS_MAX];
+    int order[FEW_KEYS_MAX];
+    int nkeys = 0, last = 0;
+    struct list_head *node, *safe;
+
+    list_for_each_safe (node, safe, head) {
+        const char *s = list_entry(node, element_t, list)->value;
+        int k = last;
+        if (!nkeys || SORT_STRCMP(s, part[last].key)) {
+            for (k = 0; k < nkeys && SORT_STRCMP(s, part[k].key); k++)
+                ;
+        }
+
+        if (k == nkeys) {
+            if (nkeys == FEW_KEYS_MAX) {
+                // too many keys, undo the partitioning in reverse
+                while (nkeys--)
+                    list_splice(&part[nkeys].list, head);
+                return false;
+            }
+            part[nkeys].key = s;
+            INIT_LIST_HEAD(&part[nkeys].list);
+            nkeys++;
+        }
+        list_move_tail(node, &part[k].list);
+        SORT_STAT_ADD(link_writes, 6);
+        last = k;
+    }
+
+    // insertion sort of the distinct keys
+    for (int i = 0; i < nkeys; i++) {
+        int j = i;
+        for (; j > 0; j--) {
+            int cmp_res = SORT_STRCMP(part[order[j - 1]].key, part[i].key);
+            if ((descend ? -cmp_res : cmp_res) <= 0)
+                break;
+            order[j] = order[j - 1];
+        }
+        order[j] = i;
+    }
+
+    for (int i = 0; i < nkeys; i++)
+        list_splice_tail(&part[order[i]].list, head);
+    SORT_STAT_ADD(link_writes, 4 * nkeys);
+    return true;
+}
+
 void q_sort(struct list_head *head, bool descend)
 {
     struct list_head *list;
@@ -379,6 +487,9 @@ void q_sort(struct list_head *head, bool descend)
     if (!head || list_empty(head) || list_is_singular(head))
         return;
 
+    if (q_has_few_keys(head) && q_sort_few_keys(head, descend))
+        return;
+
     // break circular
     head->prev->next = NULL;
     head->prev = NULL;
@@ -395,6 +506,7 @@ void q_sort(struct list_head *head, bool descend)
 
         curr->prev = NULL;
         curr->next = NULL;
+        SORT_STAT_ADD(link_writes, 2);
 
         list = next;
 
@@ -420,42 +532,170 @@ void q_sort(struct list_head *head, bool descend)
     while (list) {
         struct list_head *next = list->next;
         list_add_tail(list, head);
+        SORT_STAT_ADD(link_writes, 4);
         list = next;
     }
 }
 
-void q_shuffle(struct list_head *head)
+/* Rao-Sandelius shuffle: every node goes to a bucket picked at random, each
+ * bucket is shuffled on its own and the buckets are joined up again, which
+ * gives every permutation with the same probability.  Buckets larger than
+ * SHUFFLE_LEAF nodes are split again, the others are shuffled by Fisher-Yates
+ * through an array that stays in cache.
+ *
+ * Walking a large queue costs a cache miss on every node.  The first split
+ * is thus as wide as possible to be the only one, and SHUFFLE_WAYS buckets
+ * are walked in step to gather their nodes, so that their misses overlap.
+ * The scratch space is static per thread and does not grow with the queue.
+ */
+#define SHUFFLE_LEAF 4096
+#define SHUFFLE_WAYS 8
+#define SHUFFLE_BUCKETS 4096 /* Of the first split */
+#define SHUFFLE_RESPLIT 64   /* Of the splits of buckets too large */
+
+typedef struct {
+    struct list_head *arr[SHUFFLE_WAYS][SHUFFLE_LEAF];
+    struct list_head *lists[SHUFFLE_WAYS];
+    int sizes[SHUFFLE_WAYS];
+    int nr; /* Buckets waiting in lists[] */
+    struct list_head buckets[SHUFFLE_BUCKETS];
+    int bucket_sizes[SHUFFLE_BUCKETS];
+} shuffle_scratch_t;
+
+static _Thread_local shuffle_scratch_t shuffle_scratch;
+
+/* Shuffle all the buckets waiting in @sc */
+static void shuffle_leaves(shuffle_scratch_t *sc)
 {
-    if (!head || list_empty(head) || list_is_singular(head))
-        return;
+    struct list_head *curr[SHUFFLE_WAYS];
+    int max = 0;
+    for (int w = 0; w < sc->nr; w++) {
+        curr[w] = sc->lists[w]->next;
+        max = sc->sizes[w] > max ? sc->sizes[w] : max;
+    }
+    for (int i = 0; i < max; i++) {
+        for (int w = 0; w < sc->nr; w++) {
+            if (i < sc->sizes[w]) {
+                sc->arr[w][i] = curr[w];
+                curr[w] = curr[w]->next;
+            }
+        }
+    }
 
-    int len = q_size(head), i = 0;
-    struct list_head **arr = malloc(len * sizeof(struct list_head *));
-    struct list_head *curr, *tmp;
+    for (int w = 0; w < sc->nr; w++) {
+        struct list_head **arr = sc->arr[w];
+        int n = sc->sizes[w];
+        for (int i = n - 1; i > 0; i--) {
+            int j = random_bounded(i + 1);
+            struct list_head *tmp = arr[i];
+            arr[i] = arr[j];
+            arr[j] = tmp;
+        }
 
-    list_for_each (curr, head) {
-        arr[i++] = curr;
+        struct list_head *head = sc->lists[w], *prev = head;
+        for (int i = 0; i < n; i++) {
+            prev->next = arr[i];
+            arr[i]->prev = prev;
+            prev = arr[i];
+        }
+        prev->next = head;
+        head->prev = prev;
     }
+    sc->nr = 0;
+}
 
-    // srand((unsigned int) time(NULL));
+/* Move the nodes of @head to @nr = 2^@shift buckets at random */
+static void shuffle_scatter(struct list_head *head,
+                            struct list_head *buckets,
+                            int *sizes,
+                            int shift)
+{
+    int nr = 1 << shift;
+    for (int b = 0; b < nr; b++) {
+        INIT_LIST_HEAD(&buckets[b]);
+        sizes[b] = 0;
+    }
 
-    for (i = len - 1; i > 0; i--) {
-        int j = rand() % (i + 1);
-        tmp = arr[i];
-        arr[i] = arr[j];
-        arr[j] = tmp;
+    uint64_t r = 0;
+    int bits = 0;
+    for (struct list_head *curr = head->next, *next; curr != head;
+         curr = next) {
+        next = curr->next;
+        if (bits < shift) {
+            r = random_u64();
+            bits = 64;
+        }
+        int b = r & (nr - 1);
+        r >>= shift;
+        bits -= shift;
+        list_add_tail(curr, &buckets[b]);
+        sizes[b]++;
     }
+    INIT_LIST_HEAD(head);
+}
 
-    for (i = 0; i + 1 < len; i++) {
-        arr[i]->next = arr[i + 1];
-        arr[i + 1]->prev = arr[i];
+static void shuffle_split(shuffle_scratch_t *sc, struct list_head *head, int n);
+
+/* Shuffle the @nr buckets, then join them up into @head */
+static void shuffle_buckets(shuffle_scratch_t *sc,
+                            struct list_head *head,
+                            struct list_head *buckets,
+                            const int *sizes,
+                            int nr)
+{
+    for (int b = 0; b < nr; b++) {
+        if (sizes[b] > SHUFFLE_LEAF) {
+            shuffle_split(sc, &buckets[b], sizes[b]);
+        } else if (sizes[b] > 1) {
+            if (sc->nr == SHUFFLE_WAYS)
+                shuffle_leaves(sc);
+            sc->lists[sc->nr] = &buckets[b];
+            sc->sizes[sc->nr++] = sizes[b];
+        }
     }
+    /* Buckets waiting may live in this frame */
+    shuffle_leaves(sc);
+    for (int b = 0; b < nr; b++)
+        list_splice_tail(&buckets[b], head);
+}
+
+/* Shuffle @head of @n > SHUFFLE_LEAF nodes, a bucket of a previous split */
+static void shuffle_split(shuffle_scratch_t *sc, struct list_head *head, int n)
+{
+    struct list_head buckets[SHUFFLE_RESPLIT];
+    int sizes[SHUFFLE_RESPLIT];
+    int shift = 1;
+    while ((1 << shift) < SHUFFLE_RESPLIT && (n >> shift) > SHUFFLE_LEAF / 2)
+        shift++;
+
+    shuffle_scatter(head, buckets, sizes, shift);
+    shuffle_buckets(sc, head, buckets, sizes, 1 << shift);
+}
 
-    head->next = arr[0];
-    arr[0]->prev = head;
+void q_shuffle(struct list_head *head)
+{
+    if (!head || list_empty(head) || list_is_singular(head))
+        return;
 
-    head->prev = arr[len - 1];
-    arr[len - 1]->next = head;
+    shuffle_scratch_t *sc = &shuffle_scratch;
+
+    /* Counting a large queue would cost a walk as long as the split */
+    int n = 0;
+    struct list_head *curr;
+    for (curr = head->next; curr != head && n <= SHUFFLE_LEAF;
+         curr = curr->next)
+        n++;
+    if (n <= SHUFFLE_LEAF) {
+        sc->lists[0] = head;
+        sc->sizes[0] = n;
+        sc->nr = 1;
+        shuffle_leaves(sc);
+        return;
+    }
 
-    free(arr);
-}
\ No newline at end of file
+    int shift = 0;
+    while ((1 << shift) < SHUFFLE_BUCKETS)
+        shift++;
+    shuffle_scatter(head, sc->buckets, sc->bucket_sizes, shift);
+    shuffle_buckets(sc, head, sc->buckets, sc->bucket_sizes, SHUFFLE_BUCKETS);
+}
@@ -30,6 +30,12 @@
 
 #include "random.h"
 
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
 #if defined(__linux__) || defined(__GNU__)
 /* We would need to include <linux/random.h>, but not every target has access
  * to the linux headers. We only need RNDGETENTCNT, so we instead inline it.
@@ -264,7 +270,7 @@ static int bsd_randombytes(void *buf, size_t n)
     /* We prefer CCRandomGenerateBytes as it returns an error code while
      * arc4random_buf may fail silently on macOS.
      */
-    return (CCRandomGenerateBytes(buf, n) == kCCSuccess);
+    return CCRandomGenerateBytes(buf, n) == kCCSuccess ? 0 : -1;
 #else
     arc4random_buf(buf, n);
     return 0;
@@ -272,7 +278,8 @@ static int bsd_randombytes(void *buf, size_t n)
 }
 #endif
 
-int randombytes(uint8_t *buf, size_t n)
+/* Entropy from the operating system, only used to seed the generator */
+static int os_randombytes(uint8_t *buf, size_t n)
 {
 #if defined(__linux__) || defined(__GNU__)
 #if defined(USE_GLIBC)
@@ -291,3 +298,173 @@ int randombytes(uint8_t *buf, size_t n)
 #error "randombytes(...) is not supported on this platform"
 #endif
 }
+
+/* Userspace generator: ChaCha20 in fast-key-erasure mode.  Every refill
+ * produces RANDOM_BLOCKS blocks of keystream under the current key.  The
+ * first 32 bytes replace the key and are wiped, and the rest is handed out
+ * and wiped as it goes.  Output already returned cannot be recovered from the
+ * state.  Every thread has a generator of its own, seeded from the operating
+ * system on first use and again in a forked child.
+ */
+#define RANDOM_BLOCKS 64
+#define RANDOM_BUF_SIZE (RANDOM_BLOCKS * 64)
+
+typedef struct {
+    uint32_t key[8];
+    size_t avail; /* Unused bytes at the end of buf */
+    unsigned fork_gen;
+    bool seeded;
+    uint8_t buf[RANDOM_BUF_SIZE];
+} chacha_rng_t;
+
+static _Thread_local chacha_rng_t rng;
+
+_Thread_local uint64_t randombit_pool;
+_Thread_local int randombit_count;
+
+/* Incremented in forked children, which must not repeat the parent */
+static volatile unsigned fork_gen = 0;
+
+static void count_fork(void)
+{
+    fork_gen++;
+}
+
+static void register_fork_handler(void)
+{
+    pthread_atfork(NULL, NULL, count_fork);
+}
+
+static inline uint32_t rotl32(uint32_t x, int n)
+{
+    return (x << n) | (x >> (32 - n));
+}
+
+#define QUARTERROUND(a, b, c, d) \
+    do {                         \
+        a += b;                  \
+        d = rotl32(d ^ a, 16);   \
+        c += d;                  \
+        b = rotl32(b ^ c, 12);   \
+        a += b;                  \
+        d = rotl32(d ^ a, 8);    \
+        c += d;                  \
+        b = rotl32(b ^ c, 7);    \
+    } while (0)
+
+static void chacha20_block(const uint32_t in[16], uint8_t out[64])
+{
+    uint32_t x[16];
+    memcpy(x, in, sizeof(x));
+    for (int i = 0; i < 10; i++) {
+        QUARTERROUND(x[0], x[4], x[8], x[12]);
+        QUARTERROUND(x[1], x[5], x[9], x[13]);
+        QUARTERROUND(x[2], x[6], x[10], x[14]);
+        QUARTERROUND(x[3], x[7], x[11], x[15]);
+        QUARTERROUND(x[0], x[5], x[10], x[15]);
+        QUARTERROUND(x[1], x[6], x[11], x[12]);
+        QUARTERROUND(x[2], x[7], x[8], x[13]);
+        QUARTERROUND(x[3], x[4], x[9], x[14]);
+    }
+    /* Serialized little-endian whatever the host */
+    for (int i = 0; i < 16; i++) {
+        uint32_t v = x[i] + in[i];
+        out[4 * i] = v;
+        out[4 * i + 1] = v >> 8;
+        out[4 * i + 2] = v >> 16;
+        out[4 * i + 3] = v >> 24;
+    }
+}
+
+static void rng_refill(chacha_rng_t *r)
+{
+    /* "expand 32-byte k", key, 64-bit block counter and zero nonce */
+    uint32_t in[16] = {0x61707865, 0x3320646e, 0x79622d32, 0x6b206574};
+    memcpy(in + 4, r->key, sizeof(r->key));
+    for (int i = 0; i < RANDOM_BLOCKS; i++) {
+        in[12] = i;
+        chacha20_block(in, r->buf + 64 * i);
+    }
+
+    for (int i = 0; i < 8; i++) {
+        const uint8_t *p = r->buf + 4 * i;
+        r->key[i] = p[0] | p[1] << 8 | p[2] << 16 | (uint32_t) p[3] << 24;
+    }
+    memset(r->buf, 0, sizeof(r->key));
+    memset(in, 0, sizeof(in));
+    r->avail = RANDOM_BUF_SIZE - sizeof(r->key);
+}
+
+static int rng_seed(chacha_rng_t *r)
+{
+    static pthread_once_t once = PTHREAD_ONCE_INIT;
+    pthread_once(&once, register_fork_handler);
+
+    unsigned gen = fork_gen;
+    if (os_randombytes((uint8_t *) r->key, sizeof(r->key)))
+        return -1;
+    r->avail = 0;
+    r->fork_gen = gen;
+    r->seeded = true;
+    randombit_count = 0;
+    return 0;
+}
+
+int randombytes(uint8_t *buf, size_t n)
+{
+    chacha_rng_t *r = &rng;
+    if ((!r->seeded || r->fork_gen != fork_gen) && rng_seed(r))
+        return -1;
+
+    while (n > 0) {
+        if (!r->avail)
+            rng_refill(r);
+        size_t chunk = n < r->avail ? n : r->avail;
+        uint8_t *src = r->buf + RANDOM_BUF_SIZE - r->avail;
+        memcpy(buf, src, chunk);
+        memset(src, 0, chunk);
+        buf += chunk;
+        n -= chunk;
+        r->avail -= chunk;
+    }
+    return 0;
+}
+
+/* For callers that have no way to report a failure.  Going on with bits or
+ * a seed left at zero would silently skew whatever uses them.
+ */
+static void randombytes_or_abort(uint8_t *buf, size_t n)
+{
+    if (randombytes(buf, n)) {
+        fprintf(stderr, "FATAL: Could not seed the random generator\n");
+        abort();
+    }
+}
+
+void randombit_refill(void)
+{
+    randombytes_or_abort((uint8_t *) &randombit_pool, sizeof(randombit_pool));
+    randombit_count = 64;
+}
+
+_Thread_local uint64_t random_xs[4];
+_Thread_local bool random_xs_seeded;
+
+void random_seed(uint64_t seed)
+{
+    /* splitmix64, which never gives xoshiro its all-zero state */
+    for (int i = 0; i < 4; i++) {
+        uint64_t z = (seed += 0x9e3779b97f4a7c15ULL);
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+        random_xs[i] = z ^ (z >> 31);
+    }
+    random_xs_seeded = true;
+}
+
+void random_seed_os(void)
+{
+    uint64_t seed;
+    randombytes_or_abort((uint8_t *) &seed, sizeof(seed));
+    random_seed(seed);
+}
@@ -1,16 +1,28 @@
 #ifndef LAB0_RANDOM_H
 #define LAB0_RANDOM_H
 
+#include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
 
+/* Cryptographically secure random bytes from a per-thread generator, seeded
+ * once from the operating system.  Return 0 on success.
+ */
 extern int randombytes(uint8_t *buf, size_t len);
 
+/* Bits handed out one at a time by randombit() */
+extern _Thread_local uint64_t randombit_pool;
+extern _Thread_local int randombit_count;
+void randombit_refill(void);
+
 static inline uint8_t randombit(void)
 {
-    uint8_t ret = 0;
-    randombytes(&ret, 1);
-    return ret & 1;
+    if (!randombit_count)
+        randombit_refill();
+    uint8_t ret = randombit_pool & 1;
+    randombit_pool >>= 1;
+    randombit_count--;
+    return ret;
 }
 
 #if INTPTR_MAX == INT64_MAX
@@ -48,4 +60,55 @@ static inline uintptr_t random_shuffle(uintptr_t x)
     return x;
 }
 
+/* Fast generator for workloads, not for secrets: xoshiro256**, one per
+ * thread.  It seeds itself from randombytes() on first use, unless
+ * random_seed() gave it a seed for a reproducible run.
+ */
+extern _Thread_local uint64_t random_xs[4];
+extern _Thread_local bool random_xs_seeded;
+
+/* Seed the generator of the calling thread, expanded by splitmix64 */
+void random_seed(uint64_t seed);
+void random_seed_os(void);
+
+static inline uint64_t random_rotl(uint64_t x, int k)
+{
+    return (x << k) | (x >> (64 - k));
+}
+
+static inline uint64_t random_u64(void)
+{
+    if (!random_xs_seeded)
+        random_seed_os();
+
+    uint64_t *s = random_xs;
+    uint64_t result = random_rotl(s[1] * 5, 7) * 9;
+    uint64_t t = s[1] << 17;
+    s[2] ^= s[0];
+    s[3] ^= s[1];
+    s[1] ^= s[2];
+    s[0] ^= s[3];
+    s[2] ^= t;
+    s[3] = random_rotl(s[3], 45);
+    return result;
+}
+
+/* Uniform in [0, bound) for bound > 0, without the bias of a modulo, by
+ * Lemire's nearly divisionless method: a division only happens for the
+ * rare draws that may need to be rejected.
+ */
+static inline uint32_t random_bounded(uint32_t bound)
+{
+    uint64_t m = (random_u64() >> 32) * bound;
+    uint32_t low = (uint32_t) m;
+    if (low < bound) {
+        uint32_t threshold = -bound % bound;
+        while (low < threshold) {
+            m = (random_u64() >> 32) * bound;
+            low = (uint32_t) m;
+        }
+    }
+    return m >> 32;
+}
+
 #endif
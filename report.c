@@ -1,11 +1,13 @@
+#include <pthread.h>
+#include <sched.h>
 #include <signal.h>
 #include <stdarg.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/resource.h>
-#include <sys/time.h>
 #include <time.h>
 #include <unistd.h>
 
@@ -29,6 +31,276 @@ static char fail_buf[1024] = "FATAL Error.  Exiting\n";
 
 static volatile int ret = 0;
 
+/* Output is queued in a ring buffer as records of a header and the text, and
+ * written out by a flusher thread, so that reporting a message costs a copy
+ * instead of writes and flushes on every file.  Only the thread that reports
+ * first uses the ring, which makes it single producer and single consumer
+ * with no lock on the way.  The mutex only serves to wake the flusher and to
+ * wait for it.  Other threads write their messages directly.
+ */
+#define LOG_RING_SIZE (1 << 20)
+#define LOG_MAX_TEXT (LOG_RING_SIZE / 4)
+#define LOG_WAKE_BYTES (LOG_RING_SIZE / 2)
+
+/* Destinations of a record */
+enum { TO_ERR = 1, TO_VERB = 2, TO_LOG = 4 };
+
+typedef struct {
+    uint32_t len;  /* Of the text following the header */
+    uint32_t dest; /* 0 for padding up to the end of the ring */
+} log_record_t;
+
+#define RECORD_BYTES(len) \
+    (sizeof(log_record_t) + (((len) + 7) & ~(size_t) 7))
+
+static char log_ring[LOG_RING_SIZE] __attribute__((aligned(8)));
+/* Positions in bytes ever written and written out, not wrapped */
+static atomic_size_t log_head, log_tail;
+
+static pthread_t flusher, producer;
+static bool flusher_running = false;
+static bool flusher_stop = false;
+static pthread_mutex_t log_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t log_wake = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t log_drained = PTHREAD_COND_INITIALIZER;
+
+/* A time limit expiring while the logger is locked would longjmp out of it and
+ * leave it locked for good, so SIGALRM waits until the lock is released.
+ */
+static void block_alarm(sigset_t *saved)
+{
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGALRM);
+    pthread_sigmask(SIG_BLOCK, &set, saved);
+}
+
+static void lock_log(sigset_t *saved)
+{
+    block_alarm(saved);
+    pthread_mutex_lock(&log_lock);
+}
+
+static void unlock_log(const sigset_t *saved)
+{
+    pthread_mutex_unlock(&log_lock);
+    pthread_sigmask(SIG_SETMASK, saved, NULL);
+}
+
+static void write_text(const char *text, size_t len, uint32_t dest, FILE *log)
+{
+    if (dest & TO_ERR)
+        fwrite(text, 1, len, errfile);
+    if (dest & TO_VERB)
+        fwrite(text, 1, len, verbfile);
+    if ((dest & TO_LOG) && log)
+        fwrite(text, 1, len, log);
+}
+
+static void flush_files(FILE *log)
+{
+    fflush(errfile);
+    if (verbfile != errfile)
+        fflush(verbfile);
+    if (log)
+        fflush(log);
+}
+
+static void *flush_loop(void *arg)
+{
+    pthread_mutex_lock(&log_lock);
+    for (;;) {
+        size_t head = atomic_load_explicit(&log_head, memory_order_acquire);
+        size_t tail = atomic_load_explicit(&log_tail, memory_order_relaxed);
+        if (head == tail) {
+            pthread_cond_broadcast(&log_drained);
+            if (flusher_stop)
+                break;
+            pthread_cond_wait(&log_wake, &log_lock);
+            continue;
+        }
+
+        FILE *log = logfile;
+        pthread_mutex_unlock(&log_lock);
+        while (tail != head) {
+            const log_record_t *r =
+                (const log_record_t *) (log_ring +
+                                        (tail & (LOG_RING_SIZE - 1)));
+            if (r->dest)
+                write_text((const char *) (r + 1), r->len, r->dest, log);
+            tail += RECORD_BYTES(r->len);
+        }
+        flush_files(log);
+        atomic_store_explicit(&log_tail, tail, memory_order_release);
+        pthread_mutex_lock(&log_lock);
+    }
+    pthread_mutex_unlock(&log_lock);
+    return NULL;
+}
+
+/* Write out everything queued and stop the flusher, at exit */
+static void stop_flusher()
+{
+    sigset_t saved;
+    lock_log(&saved);
+    flusher_stop = true;
+    pthread_cond_signal(&log_wake);
+    unlock_log(&saved);
+    pthread_join(flusher, NULL);
+    flusher_running = false;
+}
+
+static void start_flusher()
+{
+    /* Signals such as SIGALRM are for the threads running commands, so the
+     * flusher inherits a mask blocking all of them
+     */
+    sigset_t all, saved;
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &saved);
+    producer = pthread_self();
+    flusher_running = !pthread_create(&flusher, NULL, flush_loop, NULL);
+    pthread_sigmask(SIG_SETMASK, &saved, NULL);
+    if (flusher_running)
+        atexit(stop_flusher);
+}
+
+/* Whether the calling thread queues its output in the ring */
+static bool use_ring()
+{
+    static pthread_once_t once = PTHREAD_ONCE_INIT;
+    pthread_once(&once, start_flusher);
+    return flusher_running && pthread_equal(producer, pthread_self());
+}
+
+void report_flush(bool wait)
+{
+    if (!flusher_running || !pthread_equal(producer, pthread_self()) ||
+        atomic_load(&log_tail) == atomic_load(&log_head))
+        return;
+
+    /* The flusher checks for output before waiting, so a wakeup missed by
+     * failing to lock, as in a signal handler, only delays the output
+     */
+    sigset_t saved;
+    block_alarm(&saved);
+    if (pthread_mutex_trylock(&log_lock)) {
+        if (!wait) {
+            pthread_sigmask(SIG_SETMASK, &saved, NULL);
+            return;
+        }
+        pthread_mutex_lock(&log_lock);
+    }
+    pthread_cond_signal(&log_wake);
+    while (wait && atomic_load(&log_tail) != atomic_load(&log_head))
+        pthread_cond_wait(&log_drained, &log_lock);
+    unlock_log(&saved);
+}
+
+void report_salvage()
+{
+    if (!flusher_running || !atomic_is_lock_free(&log_head))
+        return;
+
+    /* Records are complete up to the head, which is only published once
+     * written.  The flusher may be writing out some of them at the same time,
+     * so a record may show twice, but none is read past the snapshot, and
+     * one whose header does not make sense ends the salvage.
+     */
+    size_t head = atomic_load(&log_head);
+    size_t tail = atomic_load(&log_tail);
+    if (head - tail > LOG_RING_SIZE)
+        return;
+    while (tail != head) {
+        const log_record_t *r =
+            (const log_record_t *) (log_ring + (tail & (LOG_RING_SIZE - 1)));
+        size_t len = r->len;
+        if (len > LOG_RING_SIZE - sizeof(log_record_t) ||
+            RECORD_BYTES(len) > head - tail)
+            return;
+        if (r->dest & (TO_ERR | TO_VERB))
+            ret = write(STDOUT_FILENO, r + 1, len);
+        tail += RECORD_BYTES(len);
+    }
+}
+
+static void push_text(const char *text, size_t len, uint32_t dest)
+{
+    if (!use_ring()) {
+        FILE *log = logfile;
+        write_text(text, len, dest, log);
+        flush_files(log);
+        return;
+    }
+
+    for (; len > LOG_MAX_TEXT; text += LOG_MAX_TEXT, len -= LOG_MAX_TEXT)
+        push_text(text, LOG_MAX_TEXT, dest);
+
+    size_t head = atomic_load_explicit(&log_head, memory_order_relaxed);
+    size_t off = head & (LOG_RING_SIZE - 1);
+    size_t need = RECORD_BYTES(len);
+    /* Records do not wrap around, the end of the ring is padded instead */
+    size_t pad = LOG_RING_SIZE - off < need ? LOG_RING_SIZE - off : 0;
+    while (head + pad + need - atomic_load(&log_tail) > LOG_RING_SIZE) {
+        report_flush(false);
+        sched_yield();
+    }
+
+    if (pad) {
+        log_record_t *r = (log_record_t *) (log_ring + off);
+        r->len = pad - sizeof(log_record_t);
+        r->dest = 0;
+        head += pad;
+        off = 0;
+    }
+    log_record_t *r = (log_record_t *) (log_ring + off);
+    r->len = len;
+    r->dest = dest;
+    memcpy(r + 1, text, len);
+    head += need;
+    atomic_store_explicit(&log_head, head, memory_order_release);
+
+    if (head - atomic_load(&log_tail) >= LOG_WAKE_BYTES)
+        report_flush(false);
+}
+
+#define BUF_SIZE 4096
+
+/* Format @fmt into @buf of BUF_SIZE bytes, or into an allocated buffer if too
+ * long for it, followed by a newline if @newline.
+ *
+ * Return: the text, to be freed unless it is @buf, with its length in @lenp
+ */
+static char *format_text(char *buf,
+                         size_t *lenp,
+                         bool newline,
+                         const char *fmt,
+                         va_list ap)
+{
+    va_list again;
+    va_copy(again, ap);
+    int len = vsnprintf(buf, BUF_SIZE - 1, fmt, ap);
+    char *text = buf;
+    if (len < 0) {
+        len = 0;
+    } else if (len >= BUF_SIZE - 1) {
+        text = malloc(len + 2);
+        if (text) {
+            vsnprintf(text, len + 1, fmt, again);
+        } else {
+            text = buf;
+            len = BUF_SIZE - 2;
+        }
+    }
+    va_end(again);
+
+    if (newline)
+        text[len++] = '\n';
+    text[len] = '\0';
+    *lenp = len;
+    return text;
+}
+
 /* Default fatal function */
 static void default_fatal_fun()
 {
@@ -47,7 +319,13 @@ void set_verblevel(int level)
 
 bool set_logfile(const char *file_name)
 {
-    logfile = fopen(file_name, "w");
+    /* Output reported so far does not go to the new file */
+    report_flush(true);
+    FILE *file = fopen(file_name, "w");
+    sigset_t saved;
+    lock_log(&saved);
+    logfile = file;
+    unlock_log(&saved);
     return logfile != NULL;
 }
 
@@ -57,9 +335,9 @@ void report_event(message_t msg, char *fmt, ...)
     bool fatal = msg == MSG_FATAL;
     // cppcheck-suppress constVariable
     static char *msg_name_text[N_MSG] = {
-        "WARNING",
-        "ERROR",
-        "FATAL ERROR",
+        "WARNING: ",
+        "ERROR: ",
+        "FATAL ERROR: ",
     };
     const char *msg_name = msg_name_text[2];
     if (msg < N_MSG)
@@ -71,21 +349,29 @@ void report_event(message_t msg, char *fmt, ...)
     if (!errfile)
         init_files(stdout, stdout);
 
+    char buffer[BUF_SIZE];
+    size_t len;
     va_start(ap, fmt);
-    fprintf(errfile, "%s: ", msg_name);
-    vfprintf(errfile, fmt, ap);
-    fprintf(errfile, "\n");
-    fflush(errfile);
+    char *text = format_text(buffer, &len, true, fmt, ap);
     va_end(ap);
+    push_text(msg_name, strlen(msg_name), TO_ERR);
+    push_text(text, len, TO_ERR);
+    if (logfile) {
+        push_text("Error: ", 7, TO_LOG);
+        push_text(text, len, TO_LOG);
+    }
+    if (text != buffer)
+        free(text);
 
+    /* The log file is closed after the first error */
+    if (logfile || fatal)
+        report_flush(true);
     if (logfile) {
-        va_start(ap, fmt);
-        fprintf(logfile, "Error: ");
-        vfprintf(logfile, fmt, ap);
-        fprintf(logfile, "\n");
-        fflush(logfile);
-        va_end(ap);
+        sigset_t saved;
+        lock_log(&saved);
         fclose(logfile);
+        logfile = NULL;
+        unlock_log(&saved);
     }
 
     if (fatal) {
@@ -95,67 +381,44 @@ void report_event(message_t msg, char *fmt, ...)
     }
 }
 
-#define BUF_SIZE 4096
 extern int web_connfd;
-void report(int level, char *fmt, ...)
+
+static void report_text(bool newline, char *fmt, va_list ap)
 {
     if (!verbfile)
         init_files(stdout, stdout);
 
     char buffer[BUF_SIZE];
-    if (level <= verblevel) {
-        va_list ap;
-        va_start(ap, fmt);
-        vfprintf(verbfile, fmt, ap);
-        fprintf(verbfile, "\n");
-        fflush(verbfile);
-        va_end(ap);
-
-        if (logfile) {
-            va_start(ap, fmt);
-            vfprintf(logfile, fmt, ap);
-            fprintf(logfile, "\n");
-            fflush(logfile);
-            va_end(ap);
-        }
-        va_start(ap, fmt);
-        vsnprintf(buffer, BUF_SIZE, fmt, ap);
-        va_end(ap);
-    }
-    if (web_connfd) {
-        int len = strlen(buffer);
-        buffer[len] = '\n';
-        buffer[len + 1] = '\0';
-        web_send(web_connfd, buffer);
-    }
+    size_t len;
+    char *text = format_text(buffer, &len, newline, fmt, ap);
+    push_text(text, len, TO_VERB | TO_LOG);
+    if (web_connfd)
+        web_send(web_connfd, text);
+    if (text != buffer)
+        free(text);
 }
 
-void report_noreturn(int level, char *fmt, ...)
+void report(int level, char *fmt, ...)
 {
-    if (!verbfile)
-        init_files(stdout, stdout);
+    /* Filtered before any formatting */
+    if (level > verblevel)
+        return;
 
-    char buffer[BUF_SIZE];
-    if (level <= verblevel) {
-        va_list ap;
-        va_start(ap, fmt);
-        vfprintf(verbfile, fmt, ap);
-        fflush(verbfile);
-        va_end(ap);
+    va_list ap;
+    va_start(ap, fmt);
+    report_text(true, fmt, ap);
+    va_end(ap);
+}
 
-        if (logfile) {
-            va_start(ap, fmt);
-            vfprintf(logfile, fmt, ap);
-            fflush(logfile);
-            va_end(ap);
-        }
-        va_start(ap, fmt);
-        vsnprintf(buffer, BUF_SIZE, fmt, ap);
-        va_end(ap);
-    }
+void report_noreturn(int level, char *fmt, ...)
+{
+    if (level > verblevel)
+        return;
 
-    if (web_connfd)
-        web_send(web_connfd, buffer);
+    va_list ap;
+    va_start(ap, fmt);
+    report_text(false, fmt, ap);
+    va_end(ap);
 }
 
 /* Functions denoting failures */
@@ -166,6 +429,7 @@ static void fail_fun(const char *format, const char *msg)
     snprintf(fail_buf, sizeof(fail_buf), format, msg);
     /* Tack on return */
     fail_buf[strlen(fail_buf)] = '\n';
+    report_flush(true);
     /* Use write to avoid any buffering issues */
     ret = write(STDOUT_FILENO, fail_buf, strlen(fail_buf) + 1);
 
@@ -184,7 +448,7 @@ static void fail_fun(const char *format, const char *msg)
 }
 
 /* Maximum number of megabytes that application can use (0 = unlimited) */
-static int mblimit = 0;
+int mblimit = 0;
 
 /* Keeping track of memory allocation */
 static size_t allocate_cnt = 0;
@@ -298,6 +562,13 @@ void free_string(char *s)
     free_block((void *) s, strlen(s) + 1);
 }
 
+uint64_t time_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
 /* Initialization of timers */
 void init_time(double *timep)
 {
@@ -306,9 +577,7 @@ void init_time(double *timep)
 
 double delta_time(double *timep)
 {
-    struct timeval tv;
-    gettimeofday(&tv, NULL);
-    double current_time = tv.tv_sec + 1.0E-6 * tv.tv_usec;
+    double current_time = time_ns() * 1.0E-9;
     double delta = current_time - *timep;
     *timep = current_time;
     return delta;
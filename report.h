@@ -3,6 +3,7 @@
 
 #include <stdarg.h>
 #include <stdbool.h>
+#include <stdint.h>
 
 /* Ways to report interesting behavior and errors */
 
@@ -26,6 +27,19 @@ void report(int verblevel, char *fmt, ...);
 /* Like report, but without return character */
 void report_noreturn(int verblevel, char *fmt, ...);
 
+/* Reported output is written out by a background thread.  Have it written
+ * soon, or wait until it is if @wait, as before writing to stdout directly.
+ */
+void report_flush(bool wait);
+
+/* Write output not written out yet, from a signal handler about to end the
+ * process
+ */
+void report_salvage();
+
+/* Maximum number of megabytes that application can use (0 = unlimited) */
+extern int mblimit;
+
 /* Attempt to call malloc.  Fail when returns NULL */
 void *malloc_or_fail(size_t bytes, const char *fun_name);
 
@@ -50,4 +64,7 @@ void init_time(double *timep);
 /* Compute time since last call with this timer and reset timer */
 double delta_time(double *timep);
 
+/* Nanoseconds on a monotonic clock, for measuring short intervals */
+uint64_t time_ns();
+
 #endif /* LAB0_REPORT_H */
@@ -0,0 +1,161 @@
+#!/usr/bin/env python3
+"""Benchmark the sort implementations over several input distributions.
+
+Every measurement runs a fresh qtest which generates the input with the 'gen'
+command, runs a single 'sort' and reads the cost of the sort call alone from
+'stats', without the checks qtest does around it.  For each distribution, size
+and sort the median and 95th percentile of the sort time are reported together
+with the peak of bytes the sort allocated through the test harness on top of
+the queue.  Comparison counts are taken from one extra run of a qtest built
+with SORT_STATS=1, when such a binary is given.
+"""
+
+import argparse
+import csv
+import json
+import math
+import os
+import re
+import statistics
+import subprocess
+import sys
+import tempfile
+
+DISTS = ['random', 'sorted', 'reverse', 'sawtooth', 'fewunique', 'prefix',
+         'zipf']
+
+# qtest options selecting each sort implementation
+ALGOS = {
+    'q_sort': ['option listsort 0'],
+    'list_sort': ['option listsort 1'],
+    'ext_sort': ['option extsort 1'],
+}
+
+# 1K to 16M elements
+SIZES = [1 << n for n in range(10, 25, 2)]
+
+FIELDS = ['dist', 'size', 'algo', 'runs', 'median', 'p95', 'min',
+          'comparisons', 'peak_bytes']
+
+
+def run_qtest(qtest, cmds):
+    """Run qtest on the commands and return its output"""
+    with tempfile.NamedTemporaryFile('w', suffix='.cmd') as f:
+        f.write('\n'.join(cmds) + '\n')
+        f.flush()
+        return subprocess.run([qtest, '-v', '1', '-f', f.name],
+                              stdout=subprocess.PIPE,
+                              stderr=subprocess.STDOUT,
+                              universal_newlines=True).stdout
+
+
+def sort_cmds(algo, dist, size, extra):
+    return ['option timelimit 0'] + ALGOS[algo] + \
+        ['new', 'gen %s %d' % (dist, size)] + extra
+
+
+def percentile(samples, pct):
+    """Nearest-rank percentile"""
+    ranked = sorted(samples)
+    return ranked[max(0, math.ceil(pct / 100 * len(ranked)) - 1)]
+
+
+def measure(args, algo, dist, size):
+    times, peaks = [], []
+    for _ in range(args.runs):
+        out = run_qtest(args.qtest,
+                        sort_cmds(algo, dist, size, ['sort', 'stats']))
+        t = re.search(r'Sort time\s*=\s*([\d.]+)', out)
+        peak = re.search(r'Sort peak bytes\s*=\s*(\d+)', out)
+        if not t or not peak or 'ERROR' in out:
+            print('%s %s %d failed:\n%s' % (algo, dist, size, out),
+                  file=sys.stderr)
+            return None
+        times.append(float(t.group(1)))
+        peaks.append(int(peak.group(1)))
+
+    cmps = None
+    if args.stats_qtest:
+        out = run_qtest(args.stats_qtest,
+                        sort_cmds(algo, dist, size, ['sort', 'stats']))
+        m = re.search(r'Comparisons\s*=\s*(\d+)', out)
+        if m:
+            cmps = int(m.group(1))
+
+    return {
+        'dist': dist,
+        'size': size,
+        'algo': algo,
+        'runs': len(times),
+        'median': statistics.median(times),
+        'p95': percentile(times, 95),
+        'min': min(times),
+        'comparisons': cmps,
+        'peak_bytes': max(peaks),
+    }
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument('-p', '--qtest', default='./qtest',
+                        help='qtest binary to time (default: %(default)s)')
+    parser.add_argument('-s', '--stats-qtest',
+                        help='qtest built with SORT_STATS=1 for comparisons')
+    parser.add_argument('-d', '--dists', default=','.join(DISTS),
+                        help='comma-separated distributions')
+    parser.add_argument('-a', '--algos', default='q_sort,list_sort',
+                        help='comma-separated sorts among %s' %
+                        ', '.join(ALGOS))
+    parser.add_argument('-m', '--max-size', type=int, default=SIZES[-1],
+                        help='largest queue size (default: %(default)s)')
+    parser.add_argument('-r', '--runs', type=int, default=5,
+                        help='runs per measurement (default: %(default)s)')
+    parser.add_argument('--csv', help='write results as CSV to this file')
+    parser.add_argument('--json', help='write results as JSON to this file')
+    args = parser.parse_args()
+
+    dists = args.dists.split(',')
+    algos = args.algos.split(',')
+    for d in dists:
+        if d not in DISTS:
+            parser.error('unknown distribution %s' % d)
+    for a in algos:
+        if a not in ALGOS:
+            parser.error('unknown sort %s' % a)
+    sizes = [n for n in SIZES if n <= args.max_size]
+
+    # qtest checks it is run from the top of the repository
+    args.qtest = os.path.abspath(args.qtest)
+    if args.stats_qtest:
+        args.stats_qtest = os.path.abspath(args.stats_qtest)
+    os.chdir(os.path.join(os.path.dirname(os.path.abspath(__file__)), '..'))
+
+    results = []
+    print('%-10s %9s %-10s %10s %10s %13s %10s' %
+          ('dist', 'size', 'algo', 'median', 'p95', 'comparisons',
+           'peak bytes'))
+    for dist in dists:
+        for size in sizes:
+            for algo in algos:
+                r = measure(args, algo, dist, size)
+                if not r:
+                    continue
+                results.append(r)
+                print('%-10s %9d %-10s %10.6f %10.6f %13s %10d' %
+                      (dist, size, algo, r['median'], r['p95'],
+                       r['comparisons'] if r['comparisons'] is not None
+                       else '-', r['peak_bytes']), flush=True)
+
+    if args.csv:
+        with open(args.csv, 'w', newline='') as f:
+            writer = csv.DictWriter(f, fieldnames=FIELDS)
+            writer.writeheader()
+            writer.writerows(results)
+    if args.json:
+        with open(args.json, 'w') as f:
+            json.dump(results, f, indent=2)
+            f.write('\n')
+
+
+if __name__ == '__main__':
+    main()
@@ -1,9 +1,11 @@
 #!/usr/bin/env python3
 
 from __future__ import print_function
+import os
 import subprocess
 import sys
 import getopt
+import tempfile
 
 
 
@@ -35,9 +37,18 @@ class Tracer:
         14: "trace-14-perf",
         15: "trace-15-perf",
         16: "trace-16-perf",
-        17: "trace-17-complexity"
+        17: "trace-17-complexity",
+        18: "trace-18-extsort",
+        19: "trace-19-blocks",
+        20: "trace-20-gen",
+        21: "trace-21-shuffle",
+        22: "trace-22-bench",
+        23: "trace-23-replay"
     }
 
+    # Traces compiled with -c and replayed with -b
+    compiledTraces = {23}
+
     traceProbs = {
         1: "Trace-01",
         2: "Trace-02",
@@ -55,10 +66,16 @@ class Tracer:
         14: "Trace-14",
         15: "Trace-15",
         16: "Trace-16",
-        17: "Trace-17"
+        17: "Trace-17",
+        18: "Trace-18",
+        19: "Trace-19",
+        20: "Trace-20",
+        21: "Trace-21",
+        22: "Trace-22",
+        23: "Trace-23"
     }
 
-    maxScores = [0, 5, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 5]
+    maxScores = [0, 5, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 5, 6, 6, 6, 6, 6, 6]
 
     RED = '\033[91m'
     GREEN = '\033[92m'
@@ -88,8 +105,17 @@ class Tracer:
             return False
         fname = "%s/%s.cmd" % (self.traceDirectory, self.traceDict[tid])
         vname = "%d" % self.verbLevel
-        clist = self.command + ["-v", vname, "-f", fname]
-
+        if tid in self.compiledTraces:
+            fd, bname = tempfile.mkstemp(suffix=".qtb")
+            os.close(fd)
+            try:
+                return (self.call(self.command + ["-c", fname, "-o", bname]) and
+                        self.call(self.command + ["-v", vname, "-b", bname]))
+            finally:
+                os.remove(bname)
+        return self.call(self.command + ["-v", vname, "-f", fname])
+
+    def call(self, clist):
         try:
             retcode = subprocess.call(clist)
         except Exception as e:
@@ -0,0 +1,44 @@
+#ifndef LAB0_SORT_STATS_H
+#define LAB0_SORT_STATS_H
+
+#include <stdint.h>
+#include <string.h>
+
+/* Counters of the work done by the sort and merge implementations, so that
+ * they can be compared on equal footing.  They are only collected in builds
+ * with SORT_STATS defined, since updating them on every comparison distorts
+ * the timing of the code being measured.
+ */
+typedef struct {
+    uint64_t cmps;        /* Element comparisons */
+    uint64_t cmp_bytes;   /* Bytes examined by string comparisons */
+    uint64_t link_writes; /* Stores to next/prev pointers of nodes */
+    uint64_t merge_calls; /* Calls merging two or more sorted lists */
+} sort_stats_t;
+
+#ifdef SORT_STATS
+
+extern sort_stats_t sort_stats;
+
+#define SORT_STAT_ADD(field, n) (sort_stats.field += (n))
+
+/* strcmp() which also accounts for the comparison and the bytes examined */
+static inline int sort_stats_strcmp(const char *a, const char *b)
+{
+    size_t i = 0;
+    while (a[i] && a[i] == b[i])
+        i++;
+    sort_stats.cmps++;
+    sort_stats.cmp_bytes += i + 1;
+    return (unsigned char) a[i] - (unsigned char) b[i];
+}
+#define SORT_STRCMP sort_stats_strcmp
+
+#else /* !SORT_STATS */
+
+#define SORT_STAT_ADD(field, n) ((void) 0)
+#define SORT_STRCMP strcmp
+
+#endif
+
+#endif /* LAB0_SORT_STATS_H */
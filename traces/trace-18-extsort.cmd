@@ -0,0 +1,22 @@
+# Test external merge sort.  The queue holds several MB of elements, all
+# resident before the sort starts.  While sorting, the run buffers and the
+# elements the sort allocates on top of the queue must stay within the 2 MB
+# limit, which qtest checks against the peak of allocated bytes
+option fail 0
+option malloc 0
+option mblimit 2
+option extsort 1
+option runsize 10000
+new
+ih RAND 200000
+sort
+reverse
+option descend 1
+sort
+option descend 0
+option runsize 1000
+sort
+ih dolphin 50000
+it gerbil 50000
+sort
+free
@@ -0,0 +1,4 @@
+# Sourced by trace-19-blocks: its block is never closed
+ih before
+repeat 2 {
+    ih never
@@ -0,0 +1,61 @@
+# Test repeat blocks, variables and macros of the command language
+option fail 0
+option malloc 0
+new
+# Nested blocks, each counting in its own variable
+repeat 3 i {
+    repeat 2 j {
+        it v$i$j
+    }
+}
+rh v00
+rh v01
+rh v10
+rh v11
+rh v20
+rh v21
+# Variables expand anywhere in a word
+set n 41
+inc n
+ih n$n
+rh n42
+inc n -2
+ih $n-$n
+rh 40-40
+# Macro arguments, also passed on to a nested macro
+define push {
+    it $1-$2
+}
+define twice {
+    push $1 x
+    push $1 y
+}
+twice a
+rh a-x
+rh a-y
+define ninth {
+    ih $9
+}
+ninth 1 2 3 4 5 6 7 8 nine
+rh nine
+# References that cannot be resolved fail the line
+fail push a
+define unknown {
+    ih $nosuch
+}
+fail unknown
+# An unknown command fails its line, but the rest of the block still runs
+define broken {
+    ih first
+    nosuch 1
+    ih second
+}
+fail broken
+rh second
+rh first
+# A block still open at the end of its file is dropped there
+fail source traces/trace-19-blocks-eof.cmd
+ih last
+rh last
+rh before
+free
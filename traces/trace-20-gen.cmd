@@ -0,0 +1,40 @@
+# Test generating queues of every distribution with gen
+option fail 0
+option malloc 0
+new
+# The ordered distributions give known strings
+gen sorted 3
+rh 0000000000
+rh 0000000001
+rh 0000000002
+gen reverse 3
+rh 0000000002
+rh 0000000001
+rh 0000000000
+gen sawtooth 4 2
+rh 0000000000
+rh 0000000001
+rh 0000000000
+rh 0000000001
+# Every distribution, all sorted together
+gen random 20000
+gen sorted 20000
+gen reverse 20000
+gen sawtooth 20000 100
+gen fewunique 20000 10
+gen prefix 20000 50
+gen zipf 20000 1000 1.1
+gen lenhist 20000 1:1,8:4,200:1
+sort
+reverse
+sort
+free
+# Bad arguments are refused
+new
+fail gen nosuch 10
+fail gen random -1
+fail gen prefix 10 0
+fail gen sorted 10 5 1.5
+fail gen lenhist 10
+fail gen lenhist 10 8:x
+free
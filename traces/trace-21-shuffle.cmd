@@ -0,0 +1,31 @@
+# Test that shuffle keeps every node, from empty queues to ones spread over
+# all of its buckets
+option fail 0
+option malloc 0
+new
+shuffle
+it only
+shuffle
+rh only
+repeat 10 i {
+    it k$i
+}
+shuffle
+size
+sort
+rh k0
+rh k1
+rt k9
+rt k8
+free
+new
+gen sorted 200000
+shuffle
+shuffle
+size
+sort
+rh 0000000000
+rh 0000000001
+rt 0000199999
+rt 0000199998
+free
@@ -0,0 +1,24 @@
+# Test bench with warmup runs, and setup and teardown around every run
+option fail 0
+option malloc 0
+new
+bench -w 2 -s it,a;it,b -t rh,b 5 rh a
+bench 3 size
+it end
+rh end
+size
+# Setup and teardown are run for the warmup runs too
+set n 0
+define count {
+    inc n
+}
+bench -w 3 -s count -t count 4 size
+ih total$n
+rh total14
+# Errors of the command or its scripts stop the benchmark
+fail bench 3 rh nosuch
+fail bench -s nosuch 3 size
+fail bench -t rh 3 size
+fail bench -x 1 3 size
+fail bench 0 size
+free
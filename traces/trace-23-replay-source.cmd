@@ -0,0 +1,2 @@
+# Sourced by trace-23-replay while it is replayed
+ih sourced
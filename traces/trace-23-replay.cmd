@@ -0,0 +1,42 @@
+# Test replaying a compiled trace.  The driver compiles this file with -c and
+# replays it with -b, so its lines only run from their compiled form
+
+option fail 0
+option malloc 0
+new
+ih b
+ih a
+it c 3
+rh a
+rh b
+rh c
+rt c
+rt c
+# Macros and blocks are collected from replayed lines
+define pair {
+    it $1-$2
+    ih $2-$1
+}
+repeat 2 i {
+    repeat 2 j {
+        pair $i $j
+    }
+}
+rh 1-1
+rh 0-1
+rt 1-1
+rt 1-0
+sort
+rh 0-0
+rh 0-0
+rh 0-1
+rh 1-0
+free
+# Sourced files are read before the next compiled line
+new
+source traces/trace-23-replay-source.cmd
+rh sourced
+fail source traces/trace-19-blocks-eof.cmd
+rh before
+fail nosuch
+free